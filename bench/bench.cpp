@@ -0,0 +1,419 @@
+#include "primitives.h"
+#include "workload.h"
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Compares rbtree::PointSet and kdtree::PointSet on the workloads of workload.h.
+// Every combination of backend, distribution and size runs in a child process
+// of its own, so the peak RSS reported for it is not inflated by the cases run
+// before; workload_rss_bytes is what the generated points and queries take of
+// it. With --stats the k-d tree counts its work (see instrumentation.h), which
+// slows it down, and every operation reports the work per op. Results are
+// written as JSON:
+//
+//   2d_tree_bench [--min-size N] [--max-size N] [--backend rbtree|kdtree]...
+//                 [--distribution NAME]... [--queries N] [--min-time SECONDS]
+//                 [--seed N] [--output FILE] [--stats]
+
+namespace {
+
+struct Options
+{
+    std::size_t min_size = 1000;
+    std::size_t max_size = 100000000;
+    std::vector<std::string> backends;
+    std::vector<workload::Distribution> distributions;
+    std::size_t queries = 1 << 14;
+    double min_time = .2;
+    std::uint64_t seed = 1;
+    std::string output;
+    bool stats = false;
+    bool help = false;
+};
+
+const std::vector<std::string> all_backends = {"rbtree", "kdtree"};
+
+// fractions of the data in the query rectangles
+constexpr double selectivities[] = {1e-4, 1e-3, 1e-2};
+constexpr std::size_t k = 10;
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// whether the set counts its work
+template <class Set, class = void>
+constexpr bool counts_work = false;
+template <class Set>
+constexpr bool counts_work<Set, std::void_t<typename Set::instrumentation_type>> = Set::instrumentation_type::enabled;
+
+class Report
+{
+public:
+    using Stats = kdtree::instrumentation::Counters (*)();
+
+    // stats gives the counters of the set, if it counts its work
+    explicit Report(std::ostream & out, Stats stats = nullptr)
+        : m_out(out)
+        , m_stats(stats)
+    {
+    }
+
+    // the work of an operation is counted from here
+    void start()
+    {
+        if (m_stats != nullptr) {
+            m_before = m_stats();
+        }
+    }
+
+    // ops operations took seconds and produced results points in total
+    void add(const std::string & name, std::size_t ops, double seconds, std::size_t results, double selectivity = 0.)
+    {
+        // keeps the numbers finite for operations below the clock resolution
+        seconds = std::max(seconds, 1e-9);
+        m_out << (m_first ? "" : ",") << "\n        {\"name\": \"" << name << "\"";
+        if (selectivity > 0.) {
+            m_out << ", \"selectivity\": " << selectivity;
+        }
+        m_out << ", \"ops\": " << ops
+              << ", \"ns_per_op\": " << seconds * 1e9 / static_cast<double>(ops)
+              << ", \"ops_per_second\": " << static_cast<double>(ops) / seconds
+              << ", \"results_per_op\": " << static_cast<double>(results) / static_cast<double>(ops);
+        if (m_stats != nullptr) {
+            namespace instrumentation = kdtree::instrumentation;
+            const auto work = m_stats() - m_before;
+            m_out << ",\n          \"work_per_op\": {";
+            for (std::size_t i = 0; i < instrumentation::counter_count; ++i) {
+                const auto counter = static_cast<instrumentation::Counter>(i);
+                m_out << (i == 0 ? "" : ", ") << '"' << instrumentation::name(counter) << "\": " << static_cast<double>(work[counter]) / static_cast<double>(ops);
+            }
+            m_out << "}";
+        }
+        m_out << "}";
+        m_first = false;
+    }
+
+private:
+    std::ostream & m_out;
+    Stats m_stats;
+    kdtree::instrumentation::Counters m_before;
+    bool m_first = true;
+};
+
+// runs f(i) on the queries in batches of doubling size until min_time has passed,
+// the results are counted so that the calls can't be optimised out
+template <class F>
+void measure(Report & report, const std::string & name, const Options & options, const F & f, double selectivity = 0.)
+{
+    std::size_t ops = 0, results = 0;
+    double seconds = 0.;
+    report.start();
+    for (std::size_t batch = 1; seconds < options.min_time; batch *= 2) {
+        const auto start = Clock::now();
+        for (std::size_t i = 0; i < batch; ++i) {
+            results += f((ops + i) % options.queries);
+        }
+        seconds += seconds_since(start);
+        ops += batch;
+    }
+    report.add(name, ops, seconds, results, selectivity);
+}
+
+// The peak of the generation, the sampled index of make_ranges() above all,
+// is dropped by resetting the high water mark of the process once the workload
+// is ready; returns the resident size at that point. Both need Linux, elsewhere
+// the peak includes the generation and the workload size is reported as 0.
+std::size_t reset_peak_rss()
+{
+#if defined(__GLIBC__)
+    // otherwise the set would reuse the freed memory of the generation unnoticed
+    ::malloc_trim(0);
+#endif
+    std::ofstream("/proc/self/clear_refs") << "5";
+    std::ifstream statm("/proc/self/statm");
+    std::size_t total = 0, resident = 0;
+    if (statm >> total >> resident) {
+        return resident * static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    }
+    return 0;
+}
+
+template <class Set>
+void run_case(const Options & options, workload::Distribution distribution, std::size_t size, std::ostream & out)
+{
+    const auto points = workload::make_points(distribution, size, options.seed);
+    const auto queries = workload::make_queries(distribution, points, options.queries, k, options.seed);
+    std::vector<std::vector<Rect>> ranges;
+    for (const double selectivity : selectivities) {
+        ranges.push_back(workload::make_ranges(points, options.queries, selectivity, options.seed));
+    }
+    out << "\"workload_rss_bytes\": " << reset_peak_rss() << ",\n      \"operations\": [";
+
+    Report::Stats stats = nullptr;
+    if constexpr (counts_work<Set>) {
+        stats = &Set::stats;
+    }
+    Report report(out, stats);
+    {
+        Set set;
+        report.start();
+        const auto start = Clock::now();
+        for (const auto & point : points) {
+            set.put(point);
+        }
+        report.add("put", size, seconds_since(start), set.size());
+    }
+    report.start();
+    const auto start = Clock::now();
+    const Set set(points);
+    report.add("bulk_load", size, seconds_since(start), set.size());
+
+    measure(report, "contains", options, [&](std::size_t i) -> std::size_t { return set.contains(queries.lookups[i]); });
+    for (std::size_t s = 0; s < ranges.size(); ++s) {
+        const auto & rects = ranges[s];
+        measure(
+                report, "range", options, [&](std::size_t i) {
+                    auto [first, last] = set.range(rects[i]);
+                    return static_cast<std::size_t>(std::distance(first, last));
+                },
+                selectivities[s]);
+    }
+    measure(report, "nearest", options, [&](std::size_t i) -> std::size_t { return set.nearest(queries.nearest[i]).has_value(); });
+    measure(report, "nearest_k", options, [&](std::size_t i) {
+        auto [first, last] = set.nearest(queries.nearest[i], queries.k);
+        return static_cast<std::size_t>(std::distance(first, last));
+    });
+    out << "]";
+}
+
+void run_case(const Options & options, const std::string & backend, workload::Distribution distribution, std::size_t size, std::ostream & out)
+{
+    if (backend == "rbtree") {
+        run_case<rbtree::PointSet>(options, distribution, size, out);
+    }
+    else if (backend == "kdtree" && options.stats) {
+        run_case<kdtree::CountingPointSet>(options, distribution, size, out);
+    }
+    else if (backend == "kdtree") {
+        run_case<kdtree::PointSet>(options, distribution, size, out);
+    }
+    else {
+        throw std::runtime_error("unknown backend " + backend);
+    }
+}
+
+// runs the case in a child process and returns its JSON object
+std::string run_isolated(const Options & options, const std::string & backend, workload::Distribution distribution, std::size_t size)
+{
+    int pipe_ends[2];
+    if (::pipe(pipe_ends) != 0) {
+        throw std::runtime_error(std::string("pipe: ") + std::strerror(errno));
+    }
+    const pid_t pid = ::fork();
+    if (pid < 0) {
+        throw std::runtime_error(std::string("fork: ") + std::strerror(errno));
+    }
+    if (pid == 0) {
+        ::close(pipe_ends[0]);
+        std::ostringstream result;
+        int status = 0;
+        try {
+            run_case(options, backend, distribution, size, result);
+        }
+        catch (const std::exception & e) {
+            std::cerr << e.what() << std::endl;
+            status = 1;
+        }
+        const std::string text = result.str();
+        for (std::size_t written = 0; written < text.size();) {
+            const ssize_t count = ::write(pipe_ends[1], text.data() + written, text.size() - written);
+            if (count <= 0) {
+                status = 1;
+                break;
+            }
+            written += static_cast<std::size_t>(count);
+        }
+        // skip the destructors and atexit handlers inherited from the parent
+        ::_exit(status);
+    }
+
+    ::close(pipe_ends[1]);
+    std::string result;
+    char buffer[4096];
+    while (true) {
+        const ssize_t count = ::read(pipe_ends[0], buffer, sizeof(buffer));
+        if (count > 0) {
+            result.append(buffer, static_cast<std::size_t>(count));
+        }
+        else if (count == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    ::close(pipe_ends[0]);
+    int status = 0;
+    rusage usage {};
+    while (::wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {
+    }
+
+    std::ostringstream out;
+    out << "{\"backend\": \"" << backend << "\", \"distribution\": \"" << workload::name(distribution) << "\", \"size\": " << size;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        // ru_maxrss is in kilobytes on Linux
+        out << ", \"peak_rss_bytes\": " << usage.ru_maxrss * 1024L << ", " << result << "}";
+    }
+    else if (WIFSIGNALED(status)) {
+        out << ", \"error\": \"killed by signal " << WTERMSIG(status) << "\"}";
+    }
+    else {
+        out << ", \"error\": \"failed\"}";
+    }
+    return out.str();
+}
+
+void usage(std::ostream & out)
+{
+    out << "usage: 2d_tree_bench [--min-size N] [--max-size N] [--backend rbtree|kdtree]...\n"
+           "                     [--distribution NAME]... [--queries N] [--min-time SECONDS]\n"
+           "                     [--seed N] [--output FILE] [--stats]\n"
+           "distributions:";
+    for (const auto distribution : workload::distributions()) {
+        out << ' ' << workload::name(distribution);
+    }
+    out << '\n';
+}
+
+Options parse(int argc, char ** argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string name = argv[i];
+        if (name == "--help") {
+            options.help = true;
+            return options;
+        }
+        if (name == "--stats") {
+            options.stats = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            throw std::runtime_error("missing value of " + name);
+        }
+        const std::string value = argv[++i];
+        if (name == "--min-size") {
+            options.min_size = std::stoull(value);
+        }
+        else if (name == "--max-size") {
+            options.max_size = std::stoull(value);
+        }
+        else if (name == "--backend") {
+            options.backends.push_back(value);
+        }
+        else if (name == "--distribution") {
+            options.distributions.push_back(workload::parse_distribution(value));
+        }
+        else if (name == "--queries") {
+            options.queries = std::stoull(value);
+        }
+        else if (name == "--min-time") {
+            options.min_time = std::stod(value);
+        }
+        else if (name == "--seed") {
+            options.seed = std::stoull(value);
+        }
+        else if (name == "--output") {
+            options.output = value;
+        }
+        else {
+            throw std::runtime_error("unknown option " + name);
+        }
+    }
+    if (options.backends.empty()) {
+        options.backends = all_backends;
+    }
+    for (const auto & backend : options.backends) {
+        if (std::find(all_backends.begin(), all_backends.end(), backend) == all_backends.end()) {
+            throw std::runtime_error("unknown backend " + backend);
+        }
+    }
+    if (options.distributions.empty()) {
+        options.distributions = workload::distributions();
+    }
+    if (options.min_size == 0 || options.min_size > options.max_size || options.queries == 0) {
+        throw std::runtime_error("sizes and the number of queries have to be positive");
+    }
+    return options;
+}
+
+} // anonymous namespace
+
+int main(int argc, char ** argv)
+{
+    Options options;
+    try {
+        options = parse(argc, argv);
+    }
+    catch (const std::exception & e) {
+        std::cerr << e.what() << std::endl;
+        usage(std::cerr);
+        return 2;
+    }
+    if (options.help) {
+        usage(std::cout);
+        return 0;
+    }
+
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
+        if (!file) {
+            std::cerr << "cannot open " << options.output << std::endl;
+            return 1;
+        }
+    }
+    std::ostream & out = options.output.empty() ? std::cout : file;
+
+    out << "{\n  \"context\": {\"seed\": " << options.seed << ", \"queries\": " << options.queries
+        << ", \"min_time\": " << options.min_time << ", \"k\": " << k
+        << ", \"stats\": " << (options.stats ? "true" : "false") << "},\n  \"benchmarks\": [";
+    bool first = true, failed = false;
+    try {
+        for (std::size_t size = options.min_size; size <= options.max_size; size = size <= options.max_size / 10 ? size * 10 : options.max_size + 1) {
+            for (const auto & distribution : options.distributions) {
+                for (const auto & backend : options.backends) {
+                    std::cerr << backend << ' ' << workload::name(distribution) << ' ' << size << std::endl;
+                    const std::string result = run_isolated(options, backend, distribution, size);
+                    failed |= result.find("\"error\"") != std::string::npos;
+                    out << (first ? "" : ",") << "\n    " << result << std::flush;
+                    first = false;
+                }
+            }
+        }
+    }
+    catch (const std::exception & e) {
+        std::cerr << e.what() << std::endl;
+        failed = true;
+    }
+    out << "\n  ]\n}" << std::endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,87 @@
+# Runs 2d_tree_bench on a tiny case and checks the JSON it writes against the
+# schema the reports are read with:
+#
+#   cmake -DBENCH=path/to/2d_tree_bench -P check_schema.cmake
+cmake_minimum_required(VERSION 3.19)
+
+execute_process(
+    COMMAND ${BENCH} --min-size 1000 --max-size 1000 --distribution uniform --queries 64 --min-time 0.001 --stats
+    OUTPUT_VARIABLE report
+    ERROR_VARIABLE progress
+    RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "2d_tree_bench failed (${result}):\n${progress}")
+endif()
+
+# fails unless the value at the path has the given JSON type
+function(expect_type type)
+    string(JSON actual ERROR_VARIABLE error TYPE "${report}" ${ARGN})
+    if (error OR NOT actual STREQUAL type)
+        message(FATAL_ERROR "${ARGN}: expected ${type}, got ${actual} ${error}")
+    endif()
+endfunction()
+
+# fails unless the value at the path is a number above zero
+function(expect_positive)
+    expect_type(NUMBER ${ARGN})
+    string(JSON value GET "${report}" ${ARGN})
+    if (NOT value GREATER 0)
+        message(FATAL_ERROR "${ARGN}: expected a positive number, got ${value}")
+    endif()
+endfunction()
+
+foreach (key seed queries min_time k)
+    expect_type(NUMBER context ${key})
+endforeach()
+expect_type(BOOLEAN context stats)
+
+set(operations put bulk_load contains range range range nearest nearest_k)
+list(LENGTH operations operation_count)
+set(counters nodes_visited nodes_scanned distance_evaluations allocations rebalances rebuilt_nodes)
+
+string(JSON benchmark_count LENGTH "${report}" benchmarks)
+if (NOT benchmark_count EQUAL 2)
+    message(FATAL_ERROR "expected a benchmark per backend, got ${benchmark_count}")
+endif()
+math(EXPR last_benchmark "${benchmark_count} - 1")
+foreach (b RANGE ${last_benchmark})
+    string(JSON backend GET "${report}" benchmarks ${b} backend)
+    string(JSON distribution GET "${report}" benchmarks ${b} distribution)
+    string(JSON size GET "${report}" benchmarks ${b} size)
+    if (NOT distribution STREQUAL "uniform" OR NOT size EQUAL 1000)
+        message(FATAL_ERROR "unexpected case ${backend} ${distribution} ${size}")
+    endif()
+    expect_positive(benchmarks ${b} peak_rss_bytes)
+    expect_type(NUMBER benchmarks ${b} workload_rss_bytes)
+
+    string(JSON count LENGTH "${report}" benchmarks ${b} operations)
+    if (NOT count EQUAL operation_count)
+        message(FATAL_ERROR "${backend}: expected ${operation_count} operations, got ${count}")
+    endif()
+    math(EXPR last_operation "${count} - 1")
+    foreach (o RANGE ${last_operation})
+        list(GET operations ${o} expected)
+        string(JSON name GET "${report}" benchmarks ${b} operations ${o} name)
+        if (NOT name STREQUAL expected)
+            message(FATAL_ERROR "${backend}: operation ${o} is ${name}, expected ${expected}")
+        endif()
+        foreach (key ops ns_per_op ops_per_second)
+            expect_positive(benchmarks ${b} operations ${o} ${key})
+        endforeach()
+        expect_type(NUMBER benchmarks ${b} operations ${o} results_per_op)
+        if (name STREQUAL "range")
+            expect_positive(benchmarks ${b} operations ${o} selectivity)
+        endif()
+        # only the k-d tree counts its work
+        if (backend STREQUAL "kdtree")
+            foreach (counter ${counters})
+                expect_type(NUMBER benchmarks ${b} operations ${o} work_per_op ${counter})
+            endforeach()
+        else()
+            string(JSON work ERROR_VARIABLE missing GET "${report}" benchmarks ${b} operations ${o} work_per_op)
+            if (NOT missing)
+                message(FATAL_ERROR "${backend}: unexpected work_per_op")
+            endif()
+        endif()
+    endforeach()
+endforeach()
@@ -0,0 +1,166 @@
+#include "workload.h"
+
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+// Writes a synthetic data set in the format PointSet(filename) reads and,
+// optionally, a matching query file with one query per line:
+//
+//   contains x y
+//   range xmin ymin xmax ymax
+//   nearest x y k
+//
+//   2d_tree_gen --distribution NAME --size N [--seed N] [--output FILE]
+//               [--queries FILE] [--count N] [--selectivity FRACTION] [--k N]
+
+namespace {
+
+struct Options
+{
+    workload::Distribution distribution = workload::Distribution::Uniform;
+    std::size_t size = 0;
+    std::uint64_t seed = 1;
+    std::string output;
+    std::string queries;
+    std::size_t count = 1000;
+    double selectivity = 1e-3;
+    std::size_t k = 10;
+    bool help = false;
+};
+
+void usage(std::ostream & out)
+{
+    out << "usage: 2d_tree_gen --distribution NAME --size N [--seed N] [--output FILE]\n"
+           "                   [--queries FILE] [--count N] [--selectivity FRACTION] [--k N]\n"
+           "distributions:";
+    for (const auto distribution : workload::distributions()) {
+        out << ' ' << workload::name(distribution);
+    }
+    out << '\n';
+}
+
+Options parse(int argc, char ** argv)
+{
+    Options options;
+    bool sized = false;
+    for (int i = 1; i < argc; ++i) {
+        const std::string name = argv[i];
+        if (name == "--help") {
+            options.help = true;
+            return options;
+        }
+        if (i + 1 == argc) {
+            throw std::runtime_error("missing value of " + name);
+        }
+        const std::string value = argv[++i];
+        if (name == "--distribution") {
+            options.distribution = workload::parse_distribution(value);
+        }
+        else if (name == "--size") {
+            options.size = std::stoull(value);
+            sized = true;
+        }
+        else if (name == "--seed") {
+            options.seed = std::stoull(value);
+        }
+        else if (name == "--output") {
+            options.output = value;
+        }
+        else if (name == "--queries") {
+            options.queries = value;
+        }
+        else if (name == "--count") {
+            options.count = std::stoull(value);
+        }
+        else if (name == "--selectivity") {
+            options.selectivity = std::stod(value);
+        }
+        else if (name == "--k") {
+            options.k = std::stoull(value);
+        }
+        else {
+            throw std::runtime_error("unknown option " + name);
+        }
+    }
+    if (!sized) {
+        throw std::runtime_error("--size is required");
+    }
+    if (!(options.selectivity > 0. && options.selectivity <= 1.)) {
+        throw std::runtime_error("--selectivity has to be in (0, 1]");
+    }
+    return options;
+}
+
+// the file is used when a name is given, standard output otherwise
+void write(const std::string & filename, std::ostream & fallback, void (*body)(std::ostream &, const Options &, const std::vector<Point> &), const Options & options, const std::vector<Point> & points)
+{
+    std::ofstream file;
+    if (!filename.empty()) {
+        file.open(filename);
+        if (!file) {
+            throw std::runtime_error("cannot open " + filename);
+        }
+    }
+    std::ostream & out = filename.empty() ? fallback : file;
+    // enough digits to read back the same doubles
+    out.precision(std::numeric_limits<double>::max_digits10);
+    body(out, options, points);
+    if (!out.flush()) {
+        throw std::runtime_error("cannot write " + (filename.empty() ? std::string("the output") : filename));
+    }
+}
+
+void write_points(std::ostream & out, const Options &, const std::vector<Point> & points)
+{
+    for (const auto & point : points) {
+        out << point.x() << ' ' << point.y() << '\n';
+    }
+}
+
+void write_queries(std::ostream & out, const Options & options, const std::vector<Point> & points)
+{
+    const auto queries = workload::make_queries(options.distribution, points, options.count, options.k, options.seed);
+    for (const auto & point : queries.lookups) {
+        out << "contains " << point.x() << ' ' << point.y() << '\n';
+    }
+    for (const auto & rect : workload::make_ranges(points, options.count, options.selectivity, options.seed)) {
+        out << "range " << rect.xmin() << ' ' << rect.ymin() << ' ' << rect.xmax() << ' ' << rect.ymax() << '\n';
+    }
+    for (const auto & point : queries.nearest) {
+        out << "nearest " << point.x() << ' ' << point.y() << ' ' << queries.k << '\n';
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char ** argv)
+{
+    Options options;
+    try {
+        options = parse(argc, argv);
+    }
+    catch (const std::exception & e) {
+        std::cerr << e.what() << std::endl;
+        usage(std::cerr);
+        return 2;
+    }
+    if (options.help) {
+        usage(std::cout);
+        return 0;
+    }
+
+    try {
+        const auto points = workload::make_points(options.distribution, options.size, options.seed);
+        write(options.output, std::cout, write_points, options, points);
+        if (!options.queries.empty()) {
+            write(options.queries, std::cout, write_queries, options, points);
+        }
+    }
+    catch (const std::exception & e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
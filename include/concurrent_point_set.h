@@ -0,0 +1,167 @@
+#pragma once
+#include "log_point_set.h"
+
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <utility>
+
+namespace kdtree {
+
+// A point set readers can query without locks while a writer keeps inserting.
+// The writer works on its own copy of the set and publish() makes an immutable
+// copy of it current; readers pin whatever version is current for as long as
+// they hold a Snapshot, so their iterators stay valid however far the writer
+// gets. Replaced versions are freed once no reader can still see them, which
+// is tracked with epochs: every reader announces the epoch it started in, and
+// a version retired in epoch e is freed when no announced epoch is e or older.
+// The check runs on every publish(), and when a reader leaves which may have
+// held the oldest retired version back, so that version is freed as soon as
+// its last reader is gone even if nothing is published. Readers which started
+// later leave without it: a version they held back is also held back by the
+// older reader, and is freed by the next publish() otherwise.
+//
+// Up to max_readers snapshots announce their epochs in slots of their own; the
+// ones beyond are only counted, and while any of them is held no retired
+// version is freed, as such a reader may see any of them. Taking a snapshot
+// never waits either way.
+//
+// Versions are logarithmic sets, whose static levels are never changed once
+// built, so they share every level but those built since: publish() copies
+// O(log N) pointers, put() costs amortised O(log^2 N) as in BasicLogPointSet,
+// and a version held by a reader only keeps the levels the writer has replaced
+// since then alive. A level is freed with the last version that holds it.
+// Being a BasicLogPointSet, a version answers contains(), range() and nearest()
+// queries only; count(), within(), erase() and the batch queries of
+// BasicPointSet are not available on a snapshot.
+template <class Metric = metric::L2>
+class BasicConcurrentPointSet
+{
+public:
+    using metric_type = Metric;
+    using Version = BasicLogPointSet<Metric>;
+    using epoch_type = std::uint64_t;
+
+    // readers which get a slot for their epoch, see above
+    static constexpr std::size_t max_readers = 128;
+
+    class Snapshot
+    {
+    public:
+        Snapshot(Snapshot && other) noexcept
+            : m_set(other.m_set)
+            , m_slot(other.m_slot)
+            , m_version(other.m_version)
+            , m_active(std::exchange(other.m_active, false))
+        {
+        }
+
+        Snapshot(const Snapshot &) = delete;
+        Snapshot & operator=(const Snapshot &) = delete;
+        Snapshot & operator=(Snapshot &&) = delete;
+
+        ~Snapshot()
+        {
+            if (!m_active) {
+                return;
+            }
+            // a reader without a slot may have seen any version
+            epoch_type epoch = 0;
+            if (m_slot != nullptr) {
+                epoch = m_slot->exchange(0);
+            }
+            else {
+                m_set->m_overflow.fetch_sub(1);
+            }
+            m_set->leave(epoch);
+        }
+
+        const Version & operator*() const
+        {
+            return *m_version;
+        }
+
+        const Version * operator->() const
+        {
+            return m_version;
+        }
+
+    private:
+        friend class BasicConcurrentPointSet;
+
+        // the slot is null for a reader counted in m_overflow
+        Snapshot(const BasicConcurrentPointSet & set, std::atomic<epoch_type> * slot, const Version & version)
+            : m_set(&set)
+            , m_slot(slot)
+            , m_version(&version)
+        {
+        }
+
+        const BasicConcurrentPointSet * m_set;
+        std::atomic<epoch_type> * m_slot;
+        const Version * m_version;
+        // false once moved from
+        bool m_active = true;
+    };
+
+    BasicConcurrentPointSet(const std::string & filename = {}, Metric metric = {});
+    BasicConcurrentPointSet(std::vector<Point> points, Metric metric = {});
+
+    BasicConcurrentPointSet(const BasicConcurrentPointSet &) = delete;
+    BasicConcurrentPointSet & operator=(const BasicConcurrentPointSet &) = delete;
+
+    ~BasicConcurrentPointSet();
+
+    // the current version, kept alive until the snapshot is destroyed
+    Snapshot snapshot() const;
+
+    // writes are serialised and only become visible to readers after publish()
+    void put(const Point &);
+    void publish();
+
+    // replaced versions which are not freed yet, as a reader may still see them
+    std::size_t retired() const;
+
+    // the same queries on the current version
+    std::size_t size() const;
+    bool contains(const Point &) const;
+    std::optional<Point> nearest(const Point &) const;
+
+private:
+    struct alignas(64) Slot
+    {
+        std::atomic<epoch_type> epoch {0};
+    };
+
+    // written by the writer, and by leaving readers which find it free
+    mutable std::mutex m_writer;
+    Version m_pending;
+    bool m_changed = false;
+    mutable std::vector<std::pair<epoch_type, const Version *>> m_retired;
+    mutable std::atomic<std::size_t> m_retired_count {0};
+    // the epoch of the oldest retired version, the largest epoch if there is none
+    mutable std::atomic<epoch_type> m_oldest_retired {std::numeric_limits<epoch_type>::max()};
+    // set by a leaving reader which found the writer busy
+    mutable std::atomic<bool> m_reclaim_wanted {false};
+
+    std::atomic<const Version *> m_current;
+    alignas(64) std::atomic<epoch_type> m_epoch {1};
+    mutable Slot m_slots[max_readers];
+    // readers which found no free slot
+    mutable std::atomic<std::size_t> m_overflow {0};
+
+    void reclaim() const;
+    // the epoch the reader announced
+    void leave(epoch_type epoch) const;
+    // stores the number of retired versions and the oldest of them
+    void publish_retired() const;
+};
+
+extern template class BasicConcurrentPointSet<metric::L2>;
+extern template class BasicConcurrentPointSet<metric::L1>;
+extern template class BasicConcurrentPointSet<metric::Chebyshev>;
+extern template class BasicConcurrentPointSet<metric::WeightedL2>;
+
+using ConcurrentPointSet = BasicConcurrentPointSet<metric::L2>;
+
+} // namespace kdtree
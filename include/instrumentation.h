@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace kdtree::instrumentation {
+
+// An instrumentation policy is told about the work of the k-d tree through
+// add(counter, n), a static function so that the tree keeps no state for it.
+// With None the calls are empty and compile to nothing.
+
+enum Counter
+{
+    // nodes whose point or children a query or an update looked at
+    NodesVisited,
+    // nodes of subtrees inside a range, reported from the in-order thread
+    // without looking at their boxes
+    NodesScanned,
+    // point to point and point to box distances
+    DistanceEvaluations,
+    // nodes taken from the pool
+    Allocations,
+    // subtrees rebuilt by put() and erase(), and the nodes they had
+    Rebalances,
+    RebuiltNodes,
+    counter_count
+};
+
+struct Counters
+{
+    std::uint64_t values[counter_count] = {};
+
+    std::uint64_t operator[](Counter counter) const
+    {
+        return values[counter];
+    }
+
+    Counters & operator+=(const Counters & other)
+    {
+        for (std::size_t i = 0; i < counter_count; ++i) {
+            values[i] += other.values[i];
+        }
+        return *this;
+    }
+
+    // the work done between two snapshots
+    friend Counters operator-(Counters a, const Counters & b)
+    {
+        for (std::size_t i = 0; i < counter_count; ++i) {
+            a.values[i] -= b.values[i];
+        }
+        return a;
+    }
+};
+
+const char * name(Counter);
+
+namespace detail {
+
+struct Block
+{
+    std::atomic<std::uint64_t> values[counter_count] = {};
+};
+
+// registers the block of its thread while the thread lives
+struct Registration
+{
+    Registration();
+    Registration(const Registration &) = delete;
+    Registration & operator=(const Registration &) = delete;
+    ~Registration();
+
+    Block block;
+};
+
+} // namespace detail
+
+struct None
+{
+    static constexpr bool enabled = false;
+
+    static void add(Counter, std::uint64_t = 1)
+    {
+    }
+
+    static Counters snapshot()
+    {
+        return {};
+    }
+};
+
+// Every thread counts in a block of its own, so counting needs neither locks
+// nor atomic read-modify-writes; the blocks are atomics only so that snapshot()
+// can read them while their threads go on. The counts of finished threads are
+// kept, a snapshot is the sum over all threads since the start of the program.
+struct Counting
+{
+    static constexpr bool enabled = true;
+
+    static void add(Counter counter, std::uint64_t n = 1)
+    {
+        auto & value = local().values[counter];
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static Counters snapshot();
+
+    // the counters of the calling thread alone
+    static Counters thread_snapshot();
+
+private:
+    static detail::Block & local()
+    {
+        thread_local detail::Registration registration;
+        return registration.block;
+    }
+};
+
+} // namespace kdtree::instrumentation
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Counts of latencies in the manner of HdrHistogram: the buckets double in
+// width every 16 of them, so a bucket is never wider than 1/16 of the values
+// in it and percentiles are that precise at any scale. One thread records and
+// any thread may take a snapshot meanwhile, without locks: the counters are
+// atomics which only their owner writes.
+class LatencyHistogram
+{
+public:
+    static constexpr std::size_t sub_buckets = 16;
+    static constexpr std::size_t bucket_count = (64 - 5) * sub_buckets + 2 * sub_buckets;
+
+    // the counts at one point in time, which can be merged and queried
+    struct Snapshot
+    {
+        std::vector<std::uint64_t> counts = std::vector<std::uint64_t>(bucket_count);
+        std::uint64_t total = 0;
+        std::uint64_t max = 0;
+
+        Snapshot & operator+=(const Snapshot & other);
+
+        // the smallest bucket bound with at least the fraction q of the values
+        // at or below it, but never more than the largest value; 0 when empty
+        std::uint64_t percentile(double q) const;
+    };
+
+    void record(std::uint64_t value)
+    {
+        auto & count = m_counts[bucket(value)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (value > m_max.load(std::memory_order_relaxed)) {
+            m_max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    Snapshot snapshot() const;
+
+    static std::size_t bucket(std::uint64_t value)
+    {
+        // values from 2 * sub_buckets on keep their highest 5 bits
+        const std::size_t shift = value < 2 * sub_buckets ? 0 : static_cast<std::size_t>(59 - __builtin_clzll(value));
+        return shift * sub_buckets + (value >> shift);
+    }
+
+    // the largest value which falls into the bucket
+    static std::uint64_t bucket_high(std::size_t index);
+
+private:
+    std::atomic<std::uint64_t> m_counts[bucket_count] = {};
+    std::atomic<std::uint64_t> m_max {0};
+};
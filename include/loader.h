@@ -0,0 +1,14 @@
+#pragma once
+#include "primitives.h"
+
+#include <string>
+#include <vector>
+
+// Reads a text file with a point per line, given as two numbers separated by
+// blanks. Empty lines are skipped; anything else throws std::runtime_error
+// naming the file and the line. An empty filename gives no points.
+// Large files are split into chunks at line boundaries which are parsed on the
+// given number of threads (0 means one per core); the points keep file order.
+std::vector<Point> load_points(const std::string & filename, std::size_t threads = 1);
+// the same on the threads of the caller's pool
+std::vector<Point> load_points(const std::string & filename, kdtree::ThreadPool & pool);
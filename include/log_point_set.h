@@ -0,0 +1,164 @@
+#pragma once
+#include "static_point_set.h"
+
+namespace kdtree {
+
+// Dynamic point set made of static trees (the Bentley-Saxe logarithmic method):
+// level i is either empty or holds exactly 2^i points. A new point is merged
+// with all the full levels below the first empty one and the result is built
+// into that level, so an insertion costs amortised O(log^2 N) and never
+// rebalances anything in place. Queries fan out over the full levels.
+// Levels are immutable and shared between copies, so copying a set takes
+// O(log N) and the copies only differ in the levels built after it.
+template <class Metric = metric::L2>
+class BasicLogPointSet
+{
+public:
+    using metric_type = Metric;
+    using Level = BasicStaticPointSet<Metric>;
+
+    class iterator
+    {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = Point;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+        using iterator_category = std::forward_iterator_tag;
+
+        iterator() = default;
+
+        reference operator*() const
+        {
+            return m_buffer ? (*m_buffer)[m_index] : m_point;
+        }
+
+        pointer operator->() const
+        {
+            return &**this;
+        }
+
+        iterator & operator++()
+        {
+            if (m_buffer) {
+                ++m_index;
+            }
+            else if (++m_current == level_end()) {
+                next_level(m_level + 1);
+            }
+            else {
+                m_point = *m_current;
+            }
+            return *this;
+        }
+
+        iterator operator++(int)
+        {
+            iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        bool operator==(const iterator & it) const
+        {
+            return m_buffer == it.m_buffer && m_index == it.m_index && m_level == it.m_level && m_current == it.m_current;
+        }
+
+        bool operator!=(const iterator & it) const
+        {
+            return !(it == *this);
+        }
+
+    private:
+        friend class BasicLogPointSet;
+
+        using level_iterator = typename Level::iterator;
+
+        // chains the points (or the points in the rectangle) of all levels, starting from the given one
+        iterator(const BasicLogPointSet & ps, std::size_t level, std::optional<Rect> rect = {})
+            : m_set(&ps)
+            , m_rect(rect)
+        {
+            next_level(level);
+        }
+
+        // iterates over query results owned by the iterators
+        iterator(std::shared_ptr<const std::vector<Point>> buffer, std::size_t index)
+            : m_buffer(std::move(buffer))
+            , m_index(index)
+        {
+        }
+
+        level_iterator level_end() const
+        {
+            return m_rect ? level_iterator() : m_set->m_levels[m_level]->end();
+        }
+
+        void next_level(std::size_t level);
+
+        const BasicLogPointSet * m_set = nullptr;
+        std::size_t m_level = 0;
+        level_iterator m_current;
+        // the levels make their points on the fly, the current one is kept here
+        Point m_point;
+        std::optional<Rect> m_rect;
+
+        std::shared_ptr<const std::vector<Point>> m_buffer;
+        std::size_t m_index = 0;
+    };
+
+    BasicLogPointSet(const std::string & filename = {}, Metric metric = {});
+    // duplicates are dropped
+    BasicLogPointSet(std::vector<Point> points, Metric metric = {});
+    explicit BasicLogPointSet(Metric metric);
+
+    template <class Iterator>
+    BasicLogPointSet(Iterator first, Iterator last, Metric metric = {})
+        : BasicLogPointSet(std::vector<Point>(first, last), std::move(metric))
+    {
+    }
+
+    bool empty() const;
+    std::size_t size() const;
+    void put(const Point &);
+    bool contains(const Point &) const;
+
+    // second iterator points to an element out of range
+    std::pair<iterator, iterator> range(const Rect &) const;
+    iterator begin() const;
+    iterator end() const;
+
+    std::optional<Point> nearest(const Point &) const;
+    // second iterator points to an element out of range, points are sorted by distance
+    std::pair<iterator, iterator> nearest(const Point & point, std::size_t k) const;
+
+    const Metric & metric() const
+    {
+        return m_metric;
+    }
+
+    friend std::ostream & operator<<(std::ostream & os, const BasicLogPointSet & p)
+    {
+        for (const auto & point : p) {
+            os << point << "\n";
+        }
+        return os << std::endl;
+    }
+
+private:
+    // null for the empty levels
+    std::vector<std::shared_ptr<const Level>> m_levels;
+    std::size_t m_size = 0;
+    Metric m_metric;
+
+    void bulk_load(std::vector<Point> & points);
+};
+
+extern template class BasicLogPointSet<metric::L2>;
+extern template class BasicLogPointSet<metric::L1>;
+extern template class BasicLogPointSet<metric::Chebyshev>;
+extern template class BasicLogPointSet<metric::WeightedL2>;
+
+using LogPointSet = BasicLogPointSet<metric::L2>;
+
+} // namespace kdtree
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// A read-only view of a whole file, mapped into memory where the platform
+// allows it and read into a buffer elsewhere, or when the file is a pipe
+// or a device. Throws std::runtime_error if the file can't be opened.
+class MappedFile
+{
+public:
+    // a hint on how the contents are going to be read
+    enum class Access
+    {
+        Sequential,
+        Random
+    };
+
+    explicit MappedFile(const std::string & filename, Access access = Access::Sequential);
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    ~MappedFile();
+
+    const char * data() const;
+    std::size_t size() const;
+
+private:
+    const char * m_data = nullptr;
+    std::size_t m_size = 0;
+    // the contents when they aren't mapped
+    std::vector<char> m_buffer;
+    // whether m_data is a mapping to release, rather than m_buffer or nothing
+    bool m_mapped = false;
+};
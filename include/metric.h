@@ -0,0 +1,91 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+
+namespace kdtree::metric {
+
+// A metric policy maps absolute coordinate deltas to a comparable distance:
+// a value which orders points the same way as the real distance but is
+// cheaper to compute. Each policy is monotonic in both deltas, so the
+// comparable distance to a splitting line, (delta, 0) or (0, delta), is a
+// lower bound for every point on the other side of it.
+
+// Euclidean distance, compared squared
+struct L2
+{
+    double operator()(double dx, double dy) const
+    {
+        return dx * dx + dy * dy;
+    }
+    double to_comparable(double distance) const
+    {
+        return distance * distance;
+    }
+    double from_comparable(double value) const
+    {
+        return std::sqrt(value);
+    }
+};
+
+// Manhattan distance
+struct L1
+{
+    double operator()(double dx, double dy) const
+    {
+        return dx + dy;
+    }
+    double to_comparable(double distance) const
+    {
+        return distance;
+    }
+    double from_comparable(double value) const
+    {
+        return value;
+    }
+};
+
+// L-infinity distance
+struct Chebyshev
+{
+    double operator()(double dx, double dy) const
+    {
+        return std::max(dx, dy);
+    }
+    double to_comparable(double distance) const
+    {
+        return distance;
+    }
+    double from_comparable(double value) const
+    {
+        return value;
+    }
+};
+
+// Euclidean distance with per-axis weights, compared squared
+class WeightedL2
+{
+public:
+    WeightedL2(double wx = 1., double wy = 1.)
+        : m_wx(wx)
+        , m_wy(wy)
+    {
+    }
+
+    double operator()(double dx, double dy) const
+    {
+        return m_wx * dx * dx + m_wy * dy * dy;
+    }
+    double to_comparable(double distance) const
+    {
+        return distance * distance;
+    }
+    double from_comparable(double value) const
+    {
+        return std::sqrt(value);
+    }
+
+private:
+    double m_wx, m_wy;
+};
+
+} // namespace kdtree::metric
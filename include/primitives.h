@@ -1,7 +1,11 @@
 #pragma once
+#include "instrumentation.h"
+#include "metric.h"
+
 #include <algorithm>
 #include <cfloat>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <limits>
 #include <map>
@@ -53,6 +57,7 @@ public:
     double distance(const Point & p) const;
 
     bool contains(const Point & p) const;
+    bool contains(const Rect &) const;
     bool intersects(const Rect &) const;
 
     bool operator==(const Rect & rhs) const;
@@ -103,7 +108,7 @@ public:
 
         iterator & operator++()
         {
-            next_point(m_current, m_rect, m_point, m_radius);
+            next_point();
             return *this;
         }
 
@@ -138,47 +143,77 @@ public:
         {
         }
 
-        iterator(const PointSet & ps, set_iterator it, const Point & point, double const radius)
+        // the radius is squared, see squared_distance()
+        iterator(const PointSet & ps, set_iterator it, const Point & point, double const radius, std::size_t ties = all_ties)
             : m_current(it)
             , m_point(point)
             , m_radius(radius)
             , m_end(ps.points.end())
+            , m_ties(ties)
+        {
+            if (it != ps.points.end() && !in_ball(*it)) {
+                (*this)++;
+            }
+        }
+
+        iterator(const PointSet & ps, const Point & point, double const radius, std::size_t ties = all_ties)
+            : iterator(ps, ps.points.begin(), point, radius, ties)
+        {
+        }
+
+        // stops at end instead of the end of the set
+        iterator(set_iterator it, set_iterator end, const Point & point, double const radius)
+            : m_current(it)
+            , m_point(point)
+            , m_radius(radius)
+            , m_end(end)
         {
-            if (it != ps.points.end() && point.distance(*it) > radius) {
+            if (it != end && !in_ball(*it)) {
                 (*this)++;
             }
         }
 
-        iterator(const PointSet & ps, const Point & point, double const radius)
-            : iterator(ps, ps.points.begin(), point, radius)
+        static constexpr std::size_t all_ties = std::numeric_limits<std::size_t>::max();
+
+        // a point on the boundary uses up one of the ties
+        bool in_ball(const Point & point)
         {
+            const double distance = squared_distance(m_point, point);
+            if (distance < m_radius || (distance == m_radius && m_ties > 0)) {
+                m_ties -= distance == m_radius ? 1 : 0;
+                return true;
+            }
+            return false;
         }
 
-        set_iterator next_point(set_iterator & it, const Rect & rect, const Point & point, double radius) const
+        void next_point()
         {
-            if (rect != Rect()) {
-                while (++it != m_end && !rect.contains(*it)) {
+            if (m_rect != Rect()) {
+                while (++m_current != m_end && !m_rect.contains(*m_current)) {
                 }
             }
-            else if (point != Point()) {
-                while (++it != m_end && point.distance(*it) > radius) {
+            else if (m_radius >= 0) {
+                while (++m_current != m_end && !in_ball(*m_current)) {
                 }
             }
             else {
-                ++it;
+                ++m_current;
             }
-            return it;
         }
 
         set_iterator m_current;
         //        const PointSet * m_ps = nullptr;
         Rect m_rect;
         Point m_point;
-        double m_radius;
+        // squared, as kdtree compares it; negative unless iterating over a ball
+        double m_radius = -1;
         set_iterator m_end;
+        // points on the boundary of the ball still to visit, so that ties don't make k nearest more than k
+        std::size_t m_ties = all_ties;
     };
 
     PointSet(const std::string & filename = {});
+    PointSet(std::vector<Point> points);
 
     bool empty() const;
     std::size_t size() const;
@@ -187,6 +222,8 @@ public:
 
     // second iterator points to an element out of range
     std::pair<iterator, iterator> range(const Rect &) const;
+    // points at most radius away from the center, second iterator points to an element out of range
+    std::pair<iterator, iterator> within(const Point & center, double radius) const;
     iterator begin() const;
     iterator end() const;
 
@@ -198,16 +235,172 @@ public:
 
 private:
     std::set<Point> points;
+
+    // the comparable distance of kdtree::metric::L2, so that both sets agree at the boundary of a ball
+    static double squared_distance(const Point & a, const Point & b)
+    {
+        const double dx = std::abs(a.x() - b.x()), dy = std::abs(a.y() - b.y());
+        return dx * dx + dy * dy;
+    }
 };
 
 } // namespace rbtree
 
 namespace kdtree {
 
-class PointSet
+class ThreadPool;
+
+namespace detail {
+
+// fixed capacity stack of pending subtrees, copies only the occupied part
+template <class T, std::size_t N>
+class FixedStack
 {
 public:
-    PointSet(const std::string & filename = {});
+    FixedStack() = default;
+
+    FixedStack(const FixedStack & other)
+        : m_size(other.m_size)
+    {
+        std::copy_n(other.m_items, m_size, m_items);
+    }
+
+    FixedStack & operator=(const FixedStack & other)
+    {
+        m_size = other.m_size;
+        std::copy_n(other.m_items, m_size, m_items);
+        return *this;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    void push(const T & item)
+    {
+        m_items[m_size++] = item;
+    }
+
+    T pop()
+    {
+        return m_items[--m_size];
+    }
+
+private:
+    std::size_t m_size = 0;
+    T m_items[N];
+};
+
+// the k best candidates of a nearest search, kept as a max-heap on comparable distance
+class KnnHeap
+{
+public:
+    using Candidate = std::pair<double, Point>;
+
+    KnnHeap(std::size_t k = 0)
+    {
+        reset(k);
+    }
+
+    void reset(std::size_t k)
+    {
+        m_k = k;
+        m_items.clear();
+        m_items.reserve(k);
+    }
+
+    bool full() const
+    {
+        return m_items.size() >= m_k;
+    }
+
+    // the distance a new candidate has to beat
+    double bound() const
+    {
+        return full() ? (m_items.empty() ? -std::numeric_limits<double>::infinity() : m_items.front().first) : std::numeric_limits<double>::infinity();
+    }
+
+    void push(double dist, const Point & point)
+    {
+        if (!full()) {
+            m_items.emplace_back(dist, point);
+            std::push_heap(m_items.begin(), m_items.end());
+        }
+        else if (dist < bound()) {
+            std::pop_heap(m_items.begin(), m_items.end());
+            m_items.back() = {dist, point};
+            std::push_heap(m_items.begin(), m_items.end());
+        }
+    }
+
+    // sorts the candidates by distance, the heap has to be reset before reuse
+    const std::vector<Candidate> & sort()
+    {
+        std::sort_heap(m_items.begin(), m_items.end());
+        return m_items;
+    }
+
+    // the points in the order of distance, shared by a pair of result iterators
+    std::shared_ptr<const std::vector<Point>> sorted_points()
+    {
+        auto points = std::make_shared<std::vector<Point>>();
+        points->reserve(m_items.size());
+        for (const auto & [dist, point] : sort()) {
+            points->push_back(point);
+        }
+        return points;
+    }
+
+private:
+    std::size_t m_k = 0;
+    std::vector<Candidate> m_items;
+};
+
+} // namespace detail
+
+// results of a batch of k nearest queries: the neighbours of the i-th query, sorted
+// by distance, are at [i * stride, (i + 1) * stride), stride = min(k, size of the set)
+struct NearestBatch
+{
+    std::size_t stride = 0;
+    std::vector<Point> points;
+    std::vector<double> distances;
+};
+
+// results of a batch of range queries: the points of the i-th rectangle are at
+// [offsets[i], offsets[i + 1]), in the order the rectangles were given
+struct RangeBatch
+{
+    std::vector<std::size_t> offsets;
+    std::vector<Point> points;
+};
+
+// Instrumentation is a policy from instrumentation.h which counts the work of
+// the operations; the default one compiles to nothing.
+template <class Metric = metric::L2, class Instrumentation = instrumentation::None>
+class BasicPointSet
+{
+public:
+    using index_type = std::uint32_t;
+    using metric_type = Metric;
+    using instrumentation_type = Instrumentation;
+
+    static constexpr index_type npos = std::numeric_limits<index_type>::max();
+    // a scapegoat tree with alpha = .7 cannot be deeper than log(2^32) / log(1 / alpha) < 64
+    static constexpr std::size_t max_depth = 96;
+
+    // builds a perfectly balanced tree, duplicates are dropped; the build runs on
+    // the given number of threads (0 means one per core) and its result doesn't depend on it
+    BasicPointSet(const std::string & filename = {}, Metric metric = {}, std::size_t threads = 1);
+    BasicPointSet(std::vector<Point> points, Metric metric = {}, std::size_t threads = 1);
+    explicit BasicPointSet(Metric metric);
+
+    template <class Iterator>
+    BasicPointSet(Iterator first, Iterator last, Metric metric = {})
+        : BasicPointSet(std::vector<Point>(first, last), std::move(metric))
+    {
+    }
 
     struct Node
     {
@@ -220,55 +413,65 @@ public:
             return !(rhs == *this);
         }
 
-        Node(const Point & p, bool is_x, const std::shared_ptr<Node> & next)
+        Node(const Point & p, bool is_x)
             : m_point(p)
-            , m_next(next)
+            , m_box(p, p)
             , is_x(is_x)
         {
         }
 
         Point m_point;
-        std::shared_ptr<Node> m_left, m_right;
-        std::weak_ptr<Node> m_next;
+        // the smallest rectangle holding the points of the subtree
+        Rect m_box;
+        // children and in-order successor are indices into the node pool
+        index_type m_left = npos, m_right = npos;
+        index_type m_next = npos;
+        // live points in the subtree, and all of its nodes including the erased ones
+        index_type m = 1, m_total = 1;
         bool is_x = true;
-        std::size_t m = 1;
+        // erased, but kept in the tree until its subtree is rebuilt
+        bool m_dead = false;
     };
 
+public:
     class iterator
     {
     public:
         using difference_type = std::ptrdiff_t;
         using value_type = Point;
-        using pointer = value_type *;
-        using reference = value_type &;
+        using pointer = const value_type *;
+        using reference = const value_type &;
         using iterator_category = std::forward_iterator_tag;
 
         iterator() = default;
 
-        iterator(std::shared_ptr<Node> node)
-            : m_node(std::move(node))
-        {
-        }
-
-        iterator(std::shared_ptr<Node> node, std::shared_ptr<Node> root)
-            : m_node(std::move(node))
-            , m_root(std::move(root))
-        {
-        }
-
-        reference operator*()
+        reference operator*() const
         {
-            return m_node->m_point;
+            return m_points != nullptr ? m_points[m_current] : m_nodes[m_current].m_point;
         }
 
-        pointer operator->()
+        pointer operator->() const
         {
-            return &m_node->m_point;
+            return &**this;
         }
 
         iterator & operator++()
         {
-            m_node = m_node->m_next.lock();
+            switch (m_mode) {
+            case Mode::Threaded:
+                m_current = m_nodes[m_current].m_next;
+                skip_dead();
+                break;
+            case Mode::Range:
+                next_in_range();
+                break;
+            case Mode::Ball:
+                next_in_ball();
+                break;
+            case Mode::Buffer:
+                ++m_current;
+                break;
+            }
             return *this;
         }
 
@@ -281,7 +484,7 @@ public:
 
         bool operator==(const iterator & it) const
         {
-            return m_node == it.m_node;
+            return m_current == it.m_current && m_nodes == it.m_nodes && m_points == it.m_points;
         }
 
         bool operator!=(const iterator & it) const
@@ -292,37 +495,197 @@ public:
         ~iterator() = default;
 
     private:
-        std::shared_ptr<Node> m_node;
-        std::shared_ptr<Node> m_root;
+        friend class BasicPointSet;
+
+        enum class Mode
+        {
+            Threaded,
+            Range,
+            Ball,
+            Buffer
+        };
+
+        iterator(const BasicPointSet & ps, index_type current)
+            : m_nodes(ps.m_nodes.data())
+            , m_current(current)
+        {
+            skip_dead();
+        }
+
+        void skip_dead()
+        {
+            while (m_current != npos && m_nodes[m_current].m_dead) {
+                m_current = m_nodes[m_current].m_next;
+            }
+        }
+
+        // iterates over query results owned by the iterators
+        iterator(std::shared_ptr<const std::vector<Point>> buffer, index_type current)
+            : m_buffer(std::move(buffer))
+            , m_points(m_buffer->data())
+            , m_current(current)
+            , m_mode(Mode::Buffer)
+        {
+        }
+
+        // walks the tree depth-first, skipping subtrees which can't intersect the rectangle
+        iterator(const BasicPointSet & ps, const Rect & rect)
+            : m_nodes(ps.m_nodes.data())
+            , m_mode(Mode::Range)
+            , m_rect(rect)
+        {
+            if (ps.m_root != npos) {
+                m_stack.push(ps.m_root);
+            }
+            next_in_range();
+        }
+
+        // the same walk, skipping subtrees whose box is farther than the radius
+        iterator(const BasicPointSet & ps, const Point & center, double radius)
+            : m_nodes(ps.m_nodes.data())
+            , m_mode(Mode::Ball)
+            , m_set(&ps)
+            , m_center(center)
+            , m_radius(radius)
+        {
+            if (ps.m_root != npos && ps.box_distance(center, ps.m_nodes[ps.m_root].m_box) <= radius) {
+                m_stack.push(ps.m_root);
+            }
+            next_in_ball();
+        }
+
+        void next_in_range();
+        void next_in_ball();
+
+        std::shared_ptr<const std::vector<Point>> m_buffer;
+        const Point * m_points = nullptr;
+        const Node * m_nodes = nullptr;
+        index_type m_current = npos;
+        Mode m_mode = Mode::Threaded;
+
+        Rect m_rect;
+        detail::FixedStack<index_type, max_depth> m_stack;
+
+        const BasicPointSet * m_set = nullptr;
+        Point m_center;
+        // comparable, see metric.h
+        double m_radius = 0;
     };
 
     bool empty() const;
     std::size_t size() const;
     void put(const Point &);
+    // returns false if there was no such point
+    bool erase(const Point &);
     bool contains(const Point &) const;
 
     // second iterator points to an element out of range
     std::pair<iterator, iterator> range(const Rect &) const;
+    // answers nearby rectangles one after another so they share the cached upper
+    // nodes, on the given number of threads (0 means one per core)
+    RangeBatch range_batch(const std::vector<Rect> & rects, std::size_t threads = 0) const;
+    // the same on the threads of the caller's pool, which is kept between batches
+    RangeBatch range_batch(const std::vector<Rect> & rects, ThreadPool & pool) const;
+    // points at most radius away from the center, second iterator points to an element out of range
+    std::pair<iterator, iterator> within(const Point & center, double radius) const;
+    // the number of points in the rectangle, without visiting the subtrees inside it
+    std::size_t count(const Rect &) const;
     iterator begin() const;
     iterator end() const;
 
+    // nearest points according to the metric
     std::optional<Point> nearest(const Point &) const;
-    // second iterator points to an element out of range
+    // second iterator points to an element out of range, points are sorted by distance
     std::pair<iterator, iterator> nearest(const Point & point, std::size_t k) const;
-    //    virtual ~PointSet();
-    friend std::ostream & operator<<(std::ostream &, const PointSet &);
-    ~PointSet() = default;
+    // answers the queries on the given number of threads, 0 means one per core
+    NearestBatch nearest_batch(const std::vector<Point> & queries, std::size_t k, std::size_t threads = 0) const;
+    // the same on the threads of the caller's pool; they keep their search buffers
+    // between batches, so a long-lived pool answers queries without allocating
+    NearestBatch nearest_batch(const std::vector<Point> & queries, std::size_t k, ThreadPool & pool) const;
+
+    // writes the tree as it is to a binary file, throws std::runtime_error on failure
+    void save(const std::string & path) const;
+    // reads a tree written by save() on the same platform, without rebuilding it;
+    // throws std::runtime_error if the file is not such a tree or is damaged
+    static BasicPointSet load(const std::string & path, Metric metric = {});
+
+    const Metric & metric() const
+    {
+        return m_metric;
+    }
+
+    // the work counted by the instrumentation policy so far, summed over all
+    // threads and all sets with the same policy; compare two snapshots to get
+    // the work done in between
+    static instrumentation::Counters stats()
+    {
+        return Instrumentation::snapshot();
+    }
+
+    friend std::ostream & operator<<(std::ostream & os, const BasicPointSet & p)
+    {
+        for (auto it = p.begin(); it != p.end(); ++it) {
+            os << *it << "\n";
+        }
+        return os << std::endl;
+    }
+
+    ~BasicPointSet() = default;
 
 private:
-    const double alpha = .7;
-    std::shared_ptr<Node> m_root, m_begin, m_end;
-    int m_size = 0;
-
-    void build_tree(std::vector<std::shared_ptr<Node>> & temp, std::shared_ptr<Node> & root, bool is_x, std::shared_ptr<Node> & end, size_t left, size_t right) const;
-    void put(std::shared_ptr<Node> &, const Point &, bool, const std::shared_ptr<Node> &, bool) const;
-    bool contains(const std::shared_ptr<Node> &, const Point &) const;
-    void range(const std::shared_ptr<Node> &, const Rect &, std::shared_ptr<Node> &, std::shared_ptr<Node> &, std::shared_ptr<Node> &) const;
-    void nearest(const std::shared_ptr<Node> &, const Point &, size_t, size_t, bool, std::map<double, std::shared_ptr<Node>> &, double) const;
-    void balance(std::shared_ptr<Node> &, bool is_x) const;
+    static constexpr double alpha = .7;
+    // subtrees with a larger share of erased nodes are rebuilt without them
+    static constexpr double max_dead_fraction = .5;
+
+    Metric m_metric;
+
+    std::vector<Node> m_nodes;
+    std::vector<index_type> m_free;
+    // nodes of the subtree being rebuilt, kept to avoid reallocating on every rebuild
+    std::vector<index_type> m_scratch;
+    index_type m_root = npos, m_begin = npos;
+    std::size_t m_size = 0;
+
+    double distance(const Point & a, const Point & b) const
+    {
+        Instrumentation::add(instrumentation::DistanceEvaluations);
+        return m_metric(std::abs(a.x() - b.x()), std::abs(a.y() - b.y()));
+    }
+
+    // lower bound of the distance to anything in the box
+    double box_distance(const Point & point, const Rect & box) const
+    {
+        Instrumentation::add(instrumentation::DistanceEvaluations);
+        return m_metric(std::max({box.xmin() - point.x(), 0., point.x() - box.xmax()}), std::max({box.ymin() - point.y(), 0., point.y() - box.ymax()}));
+    }
+
+    index_type allocate(const Point &, bool is_x);
+    void release(index_type);
+    bool goes_left(const Node &, const Point &) const;
+    index_type leftmost(index_type) const;
+
+    // runs on the pool if there is one
+    void bulk_load(std::vector<Point> & points, ThreadPool * workers);
+    // sorted tells that the range is in (x, y) order, as the whole input is at the root
+    void build_balanced(std::vector<Point> & points, std::vector<Point> & scratch, std::size_t left, std::size_t right, bool is_x, bool sorted, index_type node, ThreadPool * pool);
+    index_type relink(index_type * first, index_type * last, bool is_x);
+    void thread(index_type node, index_type & prev);
+    void balance(const index_type * path, std::size_t i);
+    void nearest(index_type, const Point &, detail::KnnHeap &) const;
+    void range(index_type, const Rect &, std::vector<Point> & out) const;
+    std::size_t count(index_type, const Rect &) const;
+    void fit_box(Node &) const;
+    // whether the links, order, boxes and counts of a loaded tree are those of a valid tree
+    bool consistent() const;
 };
+
+extern template class BasicPointSet<metric::L2>;
+extern template class BasicPointSet<metric::L1>;
+extern template class BasicPointSet<metric::Chebyshev>;
+extern template class BasicPointSet<metric::WeightedL2>;
+extern template class BasicPointSet<metric::L2, instrumentation::Counting>;
+
+using PointSet = BasicPointSet<metric::L2>;
+using CountingPointSet = BasicPointSet<metric::L2, instrumentation::Counting>;
+
 } // namespace kdtree
@@ -0,0 +1,264 @@
+#pragma once
+#include "primitives.h"
+
+namespace kdtree {
+
+namespace detail {
+
+// what operator-> of an iterator returns when its points are made on the fly
+class PointProxy
+{
+public:
+    explicit PointProxy(const Point & point)
+        : m_point(point)
+    {
+    }
+
+    const Point * operator->() const
+    {
+        return &m_point;
+    }
+
+private:
+    Point m_point;
+};
+
+} // namespace detail
+
+// Immutable k-d tree stored as a single array in median order: the subtree over
+// [first, last) has its root in the middle of the range and its children in the
+// halves on either side, so nodes are found by index arithmetic alone. Points are
+// ordered by the splitting coordinate and then by the other one, which makes the
+// order total and lets contains() follow a single path.
+// Subtrees of at most bucket_size points are leaves which are not split any
+// further; they are scanned linearly over separate x[] and y[] arrays, two
+// points at a time where SSE2 is available. These arrays are all the set
+// stores, so its iterators make the points they visit on the fly.
+// Nothing but array positions links the nodes, so the arrays can be written to
+// an index file by save() and queried in place after open() maps it: opening
+// takes constant time and all processes mapping a file share its pages.
+template <class Metric = metric::L2>
+class BasicStaticPointSet
+{
+public:
+    using index_type = std::uint32_t;
+    using metric_type = Metric;
+
+    // halving a range of 2^32 points takes at most 33 levels
+    static constexpr std::size_t max_depth = 40;
+    // leaf scans report their matches as a 64 bit mask
+    static constexpr std::size_t max_bucket_size = 64;
+    static constexpr std::size_t default_bucket_size = 32;
+
+    struct Subtree
+    {
+        index_type first = 0, last = 0;
+        bool is_x = true;
+    };
+
+    class iterator
+    {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = Point;
+        using pointer = detail::PointProxy;
+        using reference = value_type;
+        using iterator_category = std::forward_iterator_tag;
+
+        iterator() = default;
+
+        reference operator*() const
+        {
+            return m_points != nullptr ? m_points[m_current] : Point(m_x[m_current], m_y[m_current]);
+        }
+
+        pointer operator->() const
+        {
+            return pointer(**this);
+        }
+
+        iterator & operator++()
+        {
+            if (m_ranged) {
+                next_in_range();
+            }
+            else {
+                ++m_current;
+            }
+            return *this;
+        }
+
+        iterator operator++(int)
+        {
+            iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        bool operator==(const iterator & it) const
+        {
+            return m_current == it.m_current && m_x == it.m_x && m_points == it.m_points;
+        }
+
+        bool operator!=(const iterator & it) const
+        {
+            return !(it == *this);
+        }
+
+    private:
+        friend class BasicStaticPointSet;
+
+        iterator(const BasicStaticPointSet & ps, std::size_t current)
+            : m_x(ps.m_x)
+            , m_y(ps.m_y)
+            , m_current(current)
+        {
+        }
+
+        // iterates over query results owned by the iterators
+        iterator(std::shared_ptr<const std::vector<Point>> buffer, std::size_t current)
+            : m_buffer(std::move(buffer))
+            , m_points(m_buffer->data())
+            , m_current(current)
+        {
+        }
+
+        // walks the tree depth-first, skipping subtrees which can't intersect the rectangle;
+        // the walk ends as a default constructed iterator
+        iterator(const BasicStaticPointSet & ps, const Rect & rect)
+            : m_x(ps.m_x)
+            , m_y(ps.m_y)
+            , m_set(&ps)
+            , m_rect(rect)
+            , m_ranged(true)
+        {
+            m_stack.push(ps.root());
+            next_in_range();
+        }
+
+        void next_in_range();
+
+        std::shared_ptr<const std::vector<Point>> m_buffer;
+        const Point * m_points = nullptr;
+        const double * m_x = nullptr, * m_y = nullptr;
+        std::size_t m_current = 0;
+
+        const BasicStaticPointSet * m_set = nullptr;
+        Rect m_rect;
+        bool m_ranged = false;
+        detail::FixedStack<Subtree, max_depth> m_stack;
+        // matches of the current leaf which are not visited yet
+        index_type m_leaf = 0;
+        std::uint64_t m_matches = 0;
+    };
+
+    // duplicates are dropped, bucket_size is clamped to [1, max_bucket_size]
+    BasicStaticPointSet(std::vector<Point> points = {}, Metric metric = {}, std::size_t bucket_size = default_bucket_size);
+    // a frozen copy of a dynamic set
+    explicit BasicStaticPointSet(const BasicPointSet<Metric> & ps, std::size_t bucket_size = default_bucket_size);
+
+    // writes the arrays to an index file, throws std::runtime_error on failure
+    void save(const std::string & path) const;
+    // maps an index file written by save() on the same platform; the file is checked
+    // for its format and size only, throws std::runtime_error if it doesn't fit
+    static BasicStaticPointSet open(const std::string & path, Metric metric = {});
+
+    template <class Iterator>
+    BasicStaticPointSet(Iterator first, Iterator last, Metric metric = {}, std::size_t bucket_size = default_bucket_size)
+        : BasicStaticPointSet(std::vector<Point>(first, last), std::move(metric), bucket_size)
+    {
+    }
+
+    bool empty() const;
+    std::size_t size() const;
+    std::size_t bucket_size() const;
+    bool contains(const Point &) const;
+
+    // second iterator points to an element out of range
+    std::pair<iterator, iterator> range(const Rect &) const;
+    iterator begin() const;
+    iterator end() const;
+
+    std::optional<Point> nearest(const Point &) const;
+    // second iterator points to an element out of range, points are sorted by distance
+    std::pair<iterator, iterator> nearest(const Point & point, std::size_t k) const;
+    // offers the points of this set to a search shared with other sets
+    void nearest(const Point & point, detail::KnnHeap & heap) const;
+
+    const Metric & metric() const
+    {
+        return m_metric;
+    }
+
+    friend std::ostream & operator<<(std::ostream & os, const BasicStaticPointSet & p)
+    {
+        for (const auto & point : p) {
+            os << point << "\n";
+        }
+        return os << std::endl;
+    }
+
+private:
+    // owns the arrays, or the mapping of the file holding them; copies share it as
+    // the arrays never change
+    std::shared_ptr<const void> m_storage;
+    // the coordinates of the points in median order
+    const double * m_x = nullptr, * m_y = nullptr;
+    index_type m_size = 0;
+    Metric m_metric;
+    index_type m_bucket_size;
+
+    struct Arrays
+    {
+        std::vector<double> x, y;
+    };
+
+    BasicStaticPointSet(Metric metric, std::size_t bucket_size);
+
+    Subtree root() const
+    {
+        return {0, m_size, true};
+    }
+
+    bool is_leaf(const Subtree & subtree) const
+    {
+        return subtree.last - subtree.first <= m_bucket_size;
+    }
+
+    Point point(index_type index) const
+    {
+        return Point(m_x[index], m_y[index]);
+    }
+
+    static index_type middle(const Subtree & subtree)
+    {
+        return subtree.first + (subtree.last - subtree.first) / 2;
+    }
+
+    static bool less(const Point & a, const Point & b, bool is_x)
+    {
+        return is_x ? std::make_pair(a.x(), a.y()) < std::make_pair(b.x(), b.y()) : std::make_pair(a.y(), a.x()) < std::make_pair(b.y(), b.x());
+    }
+
+    double distance(const Point & a, const Point & b) const
+    {
+        return m_metric(std::abs(a.x() - b.x()), std::abs(a.y() - b.y()));
+    }
+
+    double axis_distance(double delta, bool is_x) const
+    {
+        return is_x ? m_metric(std::abs(delta), 0.) : m_metric(0., std::abs(delta));
+    }
+
+    void build(std::vector<Point> & points, const Subtree & subtree) const;
+    void nearest(const Subtree & subtree, const Point & point, detail::KnnHeap & heap) const;
+};
+
+extern template class BasicStaticPointSet<metric::L2>;
+extern template class BasicStaticPointSet<metric::L1>;
+extern template class BasicStaticPointSet<metric::Chebyshev>;
+extern template class BasicStaticPointSet<metric::WeightedL2>;
+
+using StaticPointSet = BasicStaticPointSet<metric::L2>;
+
+} // namespace kdtree
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace kdtree {
+
+// Fork-join thread pool with work stealing. Every worker keeps its own deque of
+// tasks: it pushes and pops at the back, so it works depth-first on what it has
+// forked itself, and idle workers steal from the front of the others, taking
+// the oldest and thus largest pieces of work. A thread waiting for a join runs
+// queued tasks meanwhile instead of blocking, so nested forks can't deadlock.
+class ThreadPool
+{
+public:
+    // threads includes the thread that calls fork_join(), 0 means one per core
+    explicit ThreadPool(std::size_t threads = 0);
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool & operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool();
+
+    std::size_t size() const;
+
+    // runs both functions, possibly in parallel, and returns when both are done;
+    // an exception from either of them is rethrown here
+    template <class F, class G>
+    void fork_join(F && f, G && g)
+    {
+        auto forked = std::forward<G>(g);
+        Task task([](void * arg) { (*static_cast<decltype(forked) *>(arg))(); }, &forked);
+        push(task);
+        // the task points into this frame, so it has to be joined whatever happens
+        std::exception_ptr error;
+        try {
+            f();
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        join(task);
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // calls f(begin, end) on consecutive pieces of [first, last) of at most grain
+    // indices; the range is split in halves, so idle threads steal the large pieces
+    template <class F>
+    void parallel_for(std::size_t first, std::size_t last, std::size_t grain, const F & f)
+    {
+        if (last - first <= std::max<std::size_t>(grain, 1)) {
+            if (first < last) {
+                f(first, last);
+            }
+            return;
+        }
+        const std::size_t mid = first + (last - first) / 2;
+        fork_join([&]() { parallel_for(first, mid, grain, f); }, [&]() { parallel_for(mid, last, grain, f); });
+    }
+
+private:
+    struct Task
+    {
+        Task(void (*run)(void *), void * arg)
+            : m_run(run)
+            , m_arg(arg)
+        {
+        }
+
+        void (*m_run)(void *);
+        void * m_arg;
+        std::atomic<bool> m_done {false};
+        std::exception_ptr m_error;
+    };
+
+    struct alignas(64) Queue
+    {
+        std::mutex m_mutex;
+        std::deque<Task *> m_tasks;
+    };
+
+    // one queue per worker and a last one shared by the threads outside the pool
+    std::vector<Queue> m_queues;
+    std::vector<std::thread> m_workers;
+
+    std::atomic<std::size_t> m_queued {0};
+    std::atomic<bool> m_stop {false};
+    std::mutex m_sleep;
+    std::condition_variable m_wake;
+
+    Queue & own_queue();
+    void push(Task & task);
+    Task * take();
+    void execute(Task & task);
+    void join(Task & task);
+    void work(std::size_t index);
+};
+
+} // namespace kdtree
@@ -0,0 +1,53 @@
+#pragma once
+#include "primitives.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Synthetic data sets and matching queries for benchmarks and stress tests.
+// Everything is derived from the seed with std::mt19937_64 and arithmetic of
+// its own rather than the standard distributions, whose output differs between
+// standard libraries, so a seed names the same workload everywhere.
+namespace workload {
+
+enum class Distribution
+{
+    // uniform in the unit square
+    Uniform,
+    // gaussian clusters around a few centers
+    Clustered,
+    // a grid of cells of which a few get most of the points, by Zipf's law
+    Zipf,
+    // all points on the diagonal, so that x and y never split differently
+    Collinear,
+    // about sqrt(N) distinct values per coordinate, points repeat
+    Grid,
+    // uniform, but sorted by x and then y
+    Sorted
+};
+
+const std::vector<Distribution> & distributions();
+std::string name(Distribution);
+// throws std::runtime_error for an unknown name
+Distribution parse_distribution(const std::string & name);
+
+std::vector<Point> make_points(Distribution, std::size_t count, std::uint64_t seed);
+
+// point queries for a data set made by make_points()
+struct Queries
+{
+    // every other one is a point of the data, the rest almost surely miss
+    std::vector<Point> lookups;
+    // drawn from the distribution of the data, never sorted
+    std::vector<Point> nearest;
+    std::size_t k = 1;
+};
+
+Queries make_queries(Distribution, const std::vector<Point> & points, std::size_t count, std::size_t k, std::uint64_t seed);
+
+// squares centered on points of the data, each containing about the given
+// fraction of its distinct points; the size is estimated on a sample of the data
+std::vector<Rect> make_ranges(const std::vector<Point> & points, std::size_t count, double selectivity, std::uint64_t seed);
+
+} // namespace workload
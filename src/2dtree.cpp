@@ -1,21 +1,30 @@
 #include "primitives.h"
+#include "loader.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <array>
 #include <cfloat>
-#include <chrono>
+#include <cstddef>
+#include <cstring>
 #include <fstream>
+#include <chrono>
 #include <random>
+#include <stdexcept>
+#include <type_traits>
 
 namespace rbtree {
 
 PointSet::PointSet(const std::string & filename)
+    : PointSet(load_points(filename))
 {
-    std::ifstream inn(filename);
-    double x, y;
-    while (inn) {
-        inn >> x >> y;
-        this->put(Point(x, y));
-    }
+}
+
+// the set is built in linear time from sorted input
+PointSet::PointSet(std::vector<Point> input)
+{
+    std::sort(input.begin(), input.end());
+    points.insert(input.begin(), input.end());
 }
 
 bool PointSet::empty() const
@@ -43,6 +52,22 @@ std::pair<PointSet::iterator, PointSet::iterator> PointSet::range(const Rect & r
     return {iterator(*this, rect), iterator(*this, points.end(), rect)};
 }
 
+// Only points with x in [center.x - radius, center.x + radius] can be in the ball.
+// Both the bounds and the distances in_ball() checks are rounded, by up to a few
+// units in the last place of the larger of the center and the radius, so the
+// window is that much wider and in_ball() decides at the edges, comparing squared
+// distances as kdtree does.
+std::pair<PointSet::iterator, PointSet::iterator> PointSet::within(const Point & center, double radius) const
+{
+    const double inf = std::numeric_limits<double>::infinity();
+    const double slack = 4 * std::numeric_limits<double>::epsilon() * (std::abs(center.x()) + radius);
+    auto first = points.lower_bound(Point(center.x() - radius - slack, -inf)), last = points.upper_bound(Point(center.x() + radius + slack, inf));
+    if (radius < 0) {
+        first = last;
+    }
+    return {iterator(first, last, center, radius * radius), iterator(*this, last)};
+}
+
 PointSet::iterator PointSet::begin() const
 {
     return iterator(*this, points.begin());
@@ -65,24 +90,25 @@ std::optional<Point> PointSet::nearest(const Point & p) const
 
 std::pair<PointSet::iterator, PointSet::iterator> PointSet::nearest(const Point & p, std::size_t k) const
 {
-    std::set<double> distances;
+    std::multiset<double> distances;
     k = std::min(size(), k);
     if (k == 0) {
         return {iterator(*this, points.end()), iterator(*this, points.end())};
     }
     for (const auto point : points) {
-        if (distances.size() == k && *distances.rbegin() < point.distance(p)) {
+        const double distance = squared_distance(point, p);
+        if (distances.size() == k && *distances.rbegin() < distance) {
             continue;
         }
         if (distances.size() == k) {
             distances.erase(--distances.end());
         }
-        distances.emplace(point.distance(p));
+        distances.emplace(distance);
     }
 
-    double radius = *(distances.rbegin());
-
-    return {iterator(*this, p, radius), iterator(*this, points.end(), p, radius)};
+    const double radius = *(distances.rbegin());
+    // the points at exactly the radius may be more than the places left for them
+    return {iterator(*this, p, radius, distances.count(radius)), iterator(*this, points.end(), p, radius)};
 }
 std::ostream & operator<<(std::ostream & strm, const PointSet & ps)
 {
@@ -98,265 +124,1025 @@ std::ostream & operator<<(std::ostream & strm, const PointSet & ps)
 
 namespace kdtree {
 
-PointSet::PointSet(const std::string & filename)
+namespace {
+
+// Orders points by the splitting coordinate and then by the other one, the same
+// order as StaticPointSet uses. Points sharing the splitting coordinate are then
+// divided between the subtrees like any others, so a run of them can't leave a
+// subtree unbalanced.
+bool axis_less(const Point & a, const Point & b, bool is_x)
+{
+    return is_x ? std::make_pair(a.x(), a.y()) < std::make_pair(b.x(), b.y()) : std::make_pair(a.y(), a.x()) < std::make_pair(b.y(), b.x());
+}
+
+// Puts the median in the order of axis_less to its place, so that everything
+// before it is less (as put() expects) and everything after it is greater.
+template <class Iterator, class Project>
+Iterator select_median(Iterator first, Iterator last, bool is_x, Project project)
+{
+    Iterator mid = first + (last - first) / 2;
+    std::nth_element(first, mid, last, [is_x, &project](const auto & a, const auto & b) { return axis_less(project(a), project(b), is_x); });
+    return mid;
+}
+
+Rect extended(const Rect & box, const Point & point)
+{
+    return Rect(Point(std::min(box.xmin(), point.x()), std::min(box.ymin(), point.y())), Point(std::max(box.xmax(), point.x()), std::max(box.ymax(), point.y())));
+}
+
+// ranges at least this large are split between threads
+constexpr std::size_t parallel_cutoff = 1 << 13;
+// a parallel partition hands out its range in blocks of this many points
+constexpr std::size_t partition_block = 1 << 12;
+// the pivot of a parallel partition is the median of this many evenly spaced points
+constexpr std::size_t pivot_samples = 63;
+
+// Does what select_median() does to [first, last) with nth instead of the middle,
+// on the pool. As long as the range is large, it is partitioned into the points
+// less than a sampled pivot, equal to it and greater than it: every block counts
+// its points of each kind, which gives it the places to copy them to in scratch,
+// and then the part holding nth is copied back and partitioned further. The
+// blocks don't depend on the pool, neither does the result.
+void parallel_select(ThreadPool & pool, Point * first, Point * nth, Point * last, Point * scratch, bool is_x)
+{
+    auto less = [is_x](const Point & a, const Point & b) { return axis_less(a, b, is_x); };
+    while (static_cast<std::size_t>(last - first) >= parallel_cutoff) {
+        const auto size = static_cast<std::size_t>(last - first);
+        Point samples[pivot_samples];
+        for (std::size_t i = 0; i < pivot_samples; ++i) {
+            samples[i] = first[i * (size - 1) / (pivot_samples - 1)];
+        }
+        std::nth_element(samples, samples + pivot_samples / 2, samples + pivot_samples, less);
+        const Point pivot = samples[pivot_samples / 2];
+
+        enum
+        {
+            Less,
+            Equal,
+            Greater,
+            Kinds
+        };
+        auto kind = [&less, &pivot](const Point & p) { return less(p, pivot) ? Less : (less(pivot, p) ? Greater : Equal); };
+        const std::size_t blocks = (size + partition_block - 1) / partition_block;
+        auto for_each_block = [&pool, blocks](const auto & f) {
+            pool.parallel_for(0, blocks, 1, [&f](std::size_t begin, std::size_t end) {
+                for (std::size_t block = begin; block < end; ++block) {
+                    f(block);
+                }
+            });
+        };
+        auto block_end = [size](std::size_t block) { return std::min(size, (block + 1) * partition_block); };
+
+        std::vector<std::array<std::size_t, Kinds>> offsets(blocks);
+        for_each_block([&](std::size_t block) {
+            auto & count = offsets[block];
+            count.fill(0);
+            for (std::size_t i = block * partition_block; i < block_end(block); ++i) {
+                ++count[kind(first[i])];
+            }
+        });
+        // the counts become the places of the blocks' points in scratch
+        std::array<std::size_t, Kinds + 1> start {};
+        for (int k = 0; k < Kinds; ++k) {
+            start[k + 1] = start[k];
+            for (auto & count : offsets) {
+                const std::size_t c = count[k];
+                count[k] = start[k + 1];
+                start[k + 1] += c;
+            }
+        }
+        for_each_block([&](std::size_t block) {
+            auto at = offsets[block];
+            for (std::size_t i = block * partition_block; i < block_end(block); ++i) {
+                scratch[at[kind(first[i])]++] = first[i];
+            }
+        });
+        for_each_block([&](std::size_t block) {
+            std::copy(scratch + block * partition_block, scratch + block_end(block), first + block * partition_block);
+        });
+
+        const auto rank = static_cast<std::size_t>(nth - first);
+        if (rank >= start[Equal] && rank < start[Greater]) {
+            return;
+        }
+        const int part = rank < start[Equal] ? Less : Greater;
+        last = first + start[part + 1];
+        first += start[part];
+        scratch += start[part];
+    }
+    std::nth_element(first, nth, last, less);
+}
+// Layout of a file written by save(): the header, the node pool and the free
+// list as they are in memory, then a checksum of everything before it.
+struct SnapshotHeader
+{
+    char magic[4];
+    std::uint32_t version;
+    // guards against files written by a build with another node layout
+    std::uint32_t node_size;
+    std::uint32_t root, begin;
+    // zero, it takes the place of the padding before size, which would be checksummed
+    std::uint32_t reserved;
+    std::uint64_t size, nodes, free;
+};
+static_assert(sizeof(SnapshotHeader) == 48, "the header has no padding");
+
+constexpr char snapshot_magic[4] = {'K', 'D', '2', 'T'};
+constexpr std::uint32_t snapshot_version = 1;
+
+// FNV-1a over the bytes
+class Checksum
 {
-    std::ifstream inn(filename);
-    double x, y;
-    std::vector<Point> data;
-    while (inn) {
-        inn >> x >> y;
-        data.push_back(Point(x, y));
+public:
+    void add(const void * data, std::size_t size)
+    {
+        const auto * bytes = static_cast<const unsigned char *>(data);
+        for (std::size_t i = 0; i < size; ++i) {
+            m_value = (m_value ^ bytes[i]) * 0x100000001b3;
+        }
     }
-    for (const Point point : data) {
-        this->put(point);
+
+    std::uint64_t value() const
+    {
+        return m_value;
     }
+
+private:
+    std::uint64_t m_value = 0xcbf29ce484222325;
+};
+
+// queries of a batch a thread takes at once
+constexpr std::size_t batch_grain = 64;
+
+// spreads the low 16 bits of v to the even bits
+std::uint32_t spread_bits(std::uint32_t v)
+{
+    v &= 0xFFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
 }
 
-bool PointSet::empty() const
+// indices of the rectangles in the Z-order of their centres, so that neighbouring
+// rectangles come one after another
+std::vector<std::size_t> morton_order(const std::vector<Rect> & rects)
 {
-    return !m_root;
+    double xmin = std::numeric_limits<double>::infinity(), ymin = xmin, xmax = -xmin, ymax = -xmin;
+    for (const auto & rect : rects) {
+        const double x = (rect.xmin() + rect.xmax()) / 2, y = (rect.ymin() + rect.ymax()) / 2;
+        xmin = std::min(xmin, x), xmax = std::max(xmax, x);
+        ymin = std::min(ymin, y), ymax = std::max(ymax, y);
+    }
+    auto quantize = [](double value, double min, double max) {
+        const double q = max > min ? (value - min) / (max - min) * 0xFFFF : 0.;
+        return static_cast<std::uint32_t>(q >= 0. ? std::min(q, 65535.) : 0.);
+    };
+
+    std::vector<std::pair<std::uint32_t, std::size_t>> keys;
+    keys.reserve(rects.size());
+    for (std::size_t i = 0; i < rects.size(); ++i) {
+        const double x = (rects[i].xmin() + rects[i].xmax()) / 2, y = (rects[i].ymin() + rects[i].ymax()) / 2;
+        keys.emplace_back(spread_bits(quantize(x, xmin, xmax)) | (spread_bits(quantize(y, ymin, ymax)) << 1), i);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<std::size_t> order;
+    order.reserve(keys.size());
+    for (const auto & key : keys) {
+        order.push_back(key.second);
+    }
+    return order;
 }
 
-std::size_t PointSet::size() const
+template <class F, class G>
+void fork_join(ThreadPool * pool, std::size_t size, F && f, G && g)
 {
-    return m_size;
+    if (pool != nullptr && size >= parallel_cutoff) {
+        pool->fork_join(std::forward<F>(f), std::forward<G>(g));
+    }
+    else {
+        f();
+        g();
+    }
 }
 
-void PointSet::put(const Point & point)
+// a merge sort over std::sort-ed pieces, the pieces are the same with or without a pool
+template <class Iterator>
+void parallel_sort(ThreadPool * pool, Iterator first, Iterator last)
 {
-    if (contains(point)) {
+    const auto size = static_cast<std::size_t>(last - first);
+    if (size < parallel_cutoff) {
+        std::sort(first, last);
         return;
     }
-    if (m_root) {
-        put(m_root, point, true, m_end, true);
-        m_begin = m_root;
-        while (m_begin->m_left) {
-            m_begin = m_begin->m_left;
+    const Iterator mid = first + size / 2;
+    fork_join(pool, size, [=]() { parallel_sort(pool, first, mid); }, [=]() { parallel_sort(pool, mid, last); });
+    std::inplace_merge(first, mid, last);
+}
+
+} // anonymous namespace
+
+template <class Metric, class Instrumentation>
+BasicPointSet<Metric, Instrumentation>::BasicPointSet(const std::string & filename, Metric metric, std::size_t threads)
+    : m_metric(std::move(metric))
+{
+    // one pool both parses the file and builds the tree
+    std::optional<ThreadPool> pool;
+    if (threads != 1) {
+        pool.emplace(threads);
+    }
+    ThreadPool * workers = pool ? &*pool : nullptr;
+    auto points = workers != nullptr ? load_points(filename, *workers) : load_points(filename);
+    bulk_load(points, workers);
+}
+
+template <class Metric, class Instrumentation>
+BasicPointSet<Metric, Instrumentation>::BasicPointSet(std::vector<Point> points, Metric metric, std::size_t threads)
+    : m_metric(std::move(metric))
+{
+    std::optional<ThreadPool> pool;
+    if (threads != 1) {
+        pool.emplace(threads);
+    }
+    bulk_load(points, pool ? &*pool : nullptr);
+}
+
+template <class Metric, class Instrumentation>
+BasicPointSet<Metric, Instrumentation>::BasicPointSet(Metric metric)
+    : m_metric(std::move(metric))
+{
+}
+
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::bulk_load(std::vector<Point> & points, ThreadPool * workers)
+{
+    parallel_sort(workers, points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+
+    // nodes are numbered in preorder, so every subtree knows its indices in advance
+    m_nodes.assign(points.size(), Node(Point(), true));
+    m_free.clear();
+    m_size = points.size();
+    m_root = points.empty() ? npos : 0;
+    // the parallel partitions of the top levels copy the points through it
+    std::vector<Point> scratch(workers != nullptr && points.size() >= parallel_cutoff ? points.size() : 0);
+    build_balanced(points, scratch, 0, points.size(), true, true, 0, workers);
+
+    index_type prev = m_begin = npos;
+    thread(m_root, prev);
+    if (prev != npos) {
+        m_nodes[prev].m_next = npos;
+    }
+}
+
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::build_balanced(std::vector<Point> & points, std::vector<Point> & scratch, std::size_t left, std::size_t right, bool is_x, bool sorted, index_type node, ThreadPool * pool)
+{
+    if (left >= right) {
+        return;
+    }
+    const std::size_t mid = left + (right - left) / 2;
+    // sorted ranges are in the order of axis_less with is_x already
+    if (!sorted && pool != nullptr && right - left >= parallel_cutoff) {
+        parallel_select(*pool, points.data() + left, points.data() + mid, points.data() + right, scratch.data() + left, is_x);
+    }
+    else if (!sorted) {
+        select_median(points.begin() + left, points.begin() + right, is_x, [](const Point & p) -> const Point & { return p; });
+    }
+    const auto node_left = node + 1, node_right = static_cast<index_type>(node + 1 + (mid - left));
+
+    Node & current = m_nodes[node];
+    current = Node(points[mid], is_x);
+    current.m_left = left < mid ? node_left : npos;
+    current.m_right = mid + 1 < right ? node_right : npos;
+    current.m = current.m_total = static_cast<index_type>(right - left);
+
+    fork_join(pool, right - left, [&]() { build_balanced(points, scratch, left, mid, !is_x, false, node_left, pool); }, [&]() { build_balanced(points, scratch, mid + 1, right, !is_x, false, node_right, pool); });
+    fit_box(current);
+}
+
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::fit_box(Node & node) const
+{
+    double xmin = node.m_point.x(), ymin = node.m_point.y(), xmax = xmin, ymax = ymin;
+    for (index_type child : {node.m_left, node.m_right}) {
+        if (child != npos) {
+            const Rect & box = m_nodes[child].m_box;
+            xmin = std::min(xmin, box.xmin()), ymin = std::min(ymin, box.ymin());
+            xmax = std::max(xmax, box.xmax()), ymax = std::max(ymax, box.ymax());
         }
     }
-    else {
-        m_begin = m_root = std::make_shared<Node>(point, true, m_end);
+    node.m_box = Rect(Point(xmin, ymin), Point(xmax, ymax));
+}
+
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::save(const std::string & path) const
+{
+    static_assert(std::is_trivially_copyable_v<Node>, "nodes are read back as they are");
+    static_assert(sizeof(Point) == 2 * sizeof(double) && sizeof(Rect) == 2 * sizeof(Point), "points and boxes have no padding");
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::copy(std::begin(snapshot_magic), std::end(snapshot_magic), header.magic);
+    header.version = snapshot_version;
+    header.node_size = sizeof(Node);
+    header.root = m_root;
+    header.begin = m_begin;
+    header.size = m_size;
+    header.nodes = m_nodes.size();
+    header.free = m_free.size();
+
+    Checksum checksum;
+    std::ofstream out(path, std::ios::binary);
+    auto write = [&out, &checksum](const void * data, std::size_t size) {
+        checksum.add(data, size);
+        out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+    };
+    write(&header, sizeof(header));
+    // the padding of the nodes is uninitialised, so they are copied field by field
+    // into zeroed pieces; otherwise the same tree would save to different bytes
+    constexpr std::size_t piece = 4096;
+    std::vector<unsigned char> staged(std::min(m_nodes.size(), piece) * sizeof(Node));
+    for (std::size_t first = 0; first < m_nodes.size(); first += piece) {
+        const std::size_t count = std::min(piece, m_nodes.size() - first);
+        std::fill(staged.begin(), staged.end(), 0);
+        for (std::size_t i = 0; i < count; ++i) {
+            unsigned char * at = staged.data() + i * sizeof(Node);
+            const Node & node = m_nodes[first + i];
+            auto copy = [at](std::size_t offset, const auto & field) { std::memcpy(at + offset, &field, sizeof(field)); };
+            copy(offsetof(Node, m_point), node.m_point);
+            copy(offsetof(Node, m_box), node.m_box);
+            copy(offsetof(Node, m_left), node.m_left);
+            copy(offsetof(Node, m_right), node.m_right);
+            copy(offsetof(Node, m_next), node.m_next);
+            copy(offsetof(Node, m), node.m);
+            copy(offsetof(Node, m_total), node.m_total);
+            copy(offsetof(Node, is_x), node.is_x);
+            copy(offsetof(Node, m_dead), node.m_dead);
+        }
+        write(staged.data(), count * sizeof(Node));
+    }
+    write(m_free.data(), m_free.size() * sizeof(index_type));
+    const std::uint64_t sum = checksum.value();
+    out.write(reinterpret_cast<const char *>(&sum), sizeof(sum));
+    if (!out.flush()) {
+        throw std::runtime_error("cannot write " + path);
     }
-    m_size++;
 }
 
-void PointSet::put(std::shared_ptr<Node> & node, const Point & point, bool is_x, const std::shared_ptr<Node> & next, bool is_balance) const
+template <class Metric, class Instrumentation>
+BasicPointSet<Metric, Instrumentation> BasicPointSet<Metric, Instrumentation>::load(const std::string & path, Metric metric)
 {
-    node->m++;
-    if ((point.x() < node->m_point.x() && node->is_x) || ((point.y() < node->m_point.y()) && !node->is_x)) {
-        if (node->m_left) {
-            put(node->m_left, point, !is_x, node, is_balance);
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    auto fail = [&path](const char * what) {
+        throw std::runtime_error(path + ": " + what);
+    };
+
+    Checksum checksum;
+    auto read = [&in, &checksum, &fail](void * data, std::size_t size) {
+        if (!in.read(static_cast<char *>(data), static_cast<std::streamsize>(size))) {
+            fail("truncated file");
         }
-        else {
-            node->m_left = std::make_shared<Node>(point, !is_x, node);
+        checksum.add(data, size);
+    };
+    SnapshotHeader header;
+    read(&header, sizeof(header));
+    if (!std::equal(std::begin(snapshot_magic), std::end(snapshot_magic), header.magic)) {
+        fail("not a k-d tree snapshot");
+    }
+    if (header.version != snapshot_version || header.node_size != sizeof(Node) || header.reserved != 0) {
+        fail("unsupported snapshot version");
+    }
+    auto valid = [&header](index_type index) { return index == npos || index < header.nodes; };
+    if (header.nodes >= npos || header.size > header.nodes || header.free > header.nodes || !valid(header.root) || !valid(header.begin)) {
+        fail("inconsistent header");
+    }
+    // a damaged count mustn't make us allocate the pool before reading it
+    const auto position = in.tellg();
+    in.seekg(0, std::ios::end);
+    const auto end = in.tellg();
+    in.seekg(position);
+    if (position < 0 || end < 0 || !in) {
+        fail("cannot read");
+    }
+    const std::uint64_t expected = header.nodes * sizeof(Node) + header.free * sizeof(index_type) + sizeof(std::uint64_t);
+    if (static_cast<std::uint64_t>(end - position) != expected) {
+        fail("file size doesn't match the header");
+    }
+
+    BasicPointSet result(std::move(metric));
+    result.m_nodes.assign(header.nodes, Node(Point(), true));
+    result.m_free.resize(header.free);
+    read(result.m_nodes.data(), result.m_nodes.size() * sizeof(Node));
+    read(result.m_free.data(), result.m_free.size() * sizeof(index_type));
+    std::uint64_t sum;
+    if (!in.read(reinterpret_cast<char *>(&sum), sizeof(sum)) || sum != checksum.value()) {
+        fail("checksum mismatch");
+    }
+    // a bool holding anything but 0 or 1 can't be read, so the flags are checked as bytes first
+    const auto * bytes = reinterpret_cast<const unsigned char *>(result.m_nodes.data());
+    for (std::size_t i = 0; i < result.m_nodes.size(); ++i, bytes += sizeof(Node)) {
+        if (bytes[offsetof(Node, is_x)] > 1 || bytes[offsetof(Node, m_dead)] > 1) {
+            fail("inconsistent snapshot");
         }
-        if (is_balance && node->m_left->m > alpha * node->m) {
-            balance(node, is_x);
+    }
+    result.m_root = header.root;
+    result.m_begin = header.begin;
+    result.m_size = header.size;
+    // the checksum only tells that the file is as it was written
+    if (!result.consistent()) {
+        fail("inconsistent snapshot");
+    }
+    return result;
+}
+
+// Every node has to be either in the tree, reachable from the root once, or on
+// the free list; the tree has to be shallow enough for the paths of put() and
+// erase(), every point has to be on the side of each ancestor that goes_left()
+// gives, every box has to hold its subtree, its counts have to be right and the
+// thread has to list it in order.
+template <class Metric, class Instrumentation>
+bool BasicPointSet<Metric, Instrumentation>::consistent() const
+{
+    const std::size_t count = m_nodes.size();
+    enum : char
+    {
+        Unseen,
+        InTree,
+        Free
+    };
+    std::vector<char> seen(count, Unseen);
+    for (index_type index : m_free) {
+        if (index >= count || seen[index] != Unseen) {
+            return false;
         }
+        seen[index] = Free;
     }
-    else {
-        if (node->m_right) {
-            put(node->m_right, point, !is_x, next, is_balance);
-            node->m_next = node->m_right;
-            while (node->m_next.lock()->m_left) {
-                node->m_next = node->m_next.lock()->m_left;
+
+    // preorder, with the depth of every node and, for either order of axis_less,
+    // the nearest ancestors whose points bound its subtree from below and above
+    struct Pending
+    {
+        index_type node;
+        std::size_t depth;
+        index_type low[2], high[2];
+    };
+    std::vector<index_type> order;
+    order.reserve(count);
+    std::vector<Pending> pending;
+    if (m_root != npos) {
+        pending.push_back({m_root, 1, {npos, npos}, {npos, npos}});
+    }
+    while (!pending.empty()) {
+        const Pending entry = pending.back();
+        pending.pop_back();
+        const index_type node = entry.node;
+        if (node >= count || seen[node] != Unseen || entry.depth >= max_depth) {
+            return false;
+        }
+        seen[node] = InTree;
+        order.push_back(node);
+        const Node & current = m_nodes[node];
+        for (bool is_x : {false, true}) {
+            const index_type low = entry.low[is_x], high = entry.high[is_x];
+            if ((low != npos && axis_less(current.m_point, m_nodes[low].m_point, is_x)) ||
+                (high != npos && !axis_less(current.m_point, m_nodes[high].m_point, is_x))) {
+                return false;
             }
         }
-        else {
-            node->m_next = node->m_right = std::make_shared<Node>(point, !is_x, next);
+        // a box holding its point and the boxes of the children holds the whole subtree
+        if (!current.m_box.contains(current.m_point)) {
+            return false;
         }
-        if (is_balance && node->m_right->m > alpha * node->m) {
-            balance(node, is_x);
+        for (index_type child : {current.m_left, current.m_right}) {
+            if (child == npos) {
+                continue;
+            }
+            if (child >= count || m_nodes[child].is_x == current.is_x || !current.m_box.contains(m_nodes[child].m_box)) {
+                return false;
+            }
+            Pending next = {child, entry.depth + 1, {entry.low[0], entry.low[1]}, {entry.high[0], entry.high[1]}};
+            (child == current.m_left ? next.high : next.low)[current.is_x] = node;
+            pending.push_back(next);
         }
     }
-}
+    if (order.size() + m_free.size() != count) {
+        return false;
+    }
 
-void PointSet::build_tree(std::vector<std::shared_ptr<Node>> & temp, std::shared_ptr<Node> & root, bool is_x, std::shared_ptr<Node> & end, size_t left, size_t right) const
-{
-    size_t mid = (left + right) / 2;
-    if (mid >= left && mid < right) {
-        if (root) {
-            put(root, temp[mid]->m_point, is_x, end, false);
+    // children come after their parent in preorder
+    std::vector<index_type> total(count), live(count);
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        const Node & current = m_nodes[*it];
+        std::size_t t = 1, l = current.m_dead ? 0 : 1;
+        for (index_type child : {current.m_left, current.m_right}) {
+            if (child != npos) {
+                t += total[child];
+                l += live[child];
+            }
         }
-        else {
-            root = std::make_shared<Node>(temp[mid]->m_point, is_x, end);
+        if (current.m_total != t || current.m != l) {
+            return false;
         }
-        build_tree(temp, root, is_x, end, left, mid);
-        build_tree(temp, root, is_x, end, mid + 1, right);
+        total[*it] = current.m_total;
+        live[*it] = current.m;
+    }
+    if ((m_root == npos ? 0 : live[m_root]) != m_size) {
+        return false;
     }
+
+    std::vector<index_type> path;
+    index_type expected = m_begin, node = m_root;
+    while (node != npos || !path.empty()) {
+        for (; node != npos; node = m_nodes[node].m_left) {
+            path.push_back(node);
+        }
+        node = path.back();
+        path.pop_back();
+        if (node != expected) {
+            return false;
+        }
+        expected = m_nodes[node].m_next;
+        node = m_nodes[node].m_right;
+    }
+    return expected == npos;
 }
 
-void PointSet::balance(std::shared_ptr<Node> & node, bool is_x) const
+template <class Metric, class Instrumentation>
+bool BasicPointSet<Metric, Instrumentation>::empty() const
 {
-    auto begin = node;
-    while (begin->m_left) {
-        begin = begin->m_left;
-    }
+    return m_size == 0;
+}
+
+template <class Metric, class Instrumentation>
+std::size_t BasicPointSet<Metric, Instrumentation>::size() const
+{
+    return m_size;
+}
 
-    auto end = node;
-    while (end->m_right) {
-        end = end->m_right;
+template <class Metric, class Instrumentation>
+typename BasicPointSet<Metric, Instrumentation>::index_type BasicPointSet<Metric, Instrumentation>::allocate(const Point & point, bool is_x)
+{
+    Instrumentation::add(instrumentation::Allocations);
+    if (m_free.empty()) {
+        m_nodes.emplace_back(point, is_x);
+        return static_cast<index_type>(m_nodes.size() - 1);
     }
+    index_type index = m_free.back();
+    m_free.pop_back();
+    m_nodes[index] = Node(point, is_x);
+    return index;
+}
 
-    std::vector<std::shared_ptr<Node>> temp;
-    temp.push_back(begin);
-    do {
-        begin = begin->m_next.lock();
-        temp.push_back(begin);
-    } while (begin.get() != end.get());
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::release(index_type index)
+{
+    m_free.push_back(index);
+}
 
-    end = end->m_next.lock();
-    node.reset();
-    build_tree(temp, node, is_x, end, 0, temp.size());
+template <class Metric, class Instrumentation>
+bool BasicPointSet<Metric, Instrumentation>::goes_left(const Node & node, const Point & point) const
+{
+    return axis_less(point, node.m_point, node.is_x);
 }
 
-bool PointSet::contains(const Point & point) const
+template <class Metric, class Instrumentation>
+typename BasicPointSet<Metric, Instrumentation>::index_type BasicPointSet<Metric, Instrumentation>::leftmost(index_type node) const
 {
-    return contains(m_root, point);
+    while (m_nodes[node].m_left != npos) {
+        node = m_nodes[node].m_left;
+    }
+    return node;
 }
 
-bool PointSet::contains(const std::shared_ptr<Node> & node, const Point & point) const
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::put(const Point & point)
 {
-    if (!node) {
-        return false;
+    if (contains(point)) {
+        return;
+    }
+    m_size++;
+    if (m_root == npos) {
+        m_begin = m_root = allocate(point, true);
+        return;
     }
 
-    if (node->m_point == point) {
-        return true;
+    index_type path[max_depth];
+    std::size_t depth = 0;
+    index_type pred = npos, next = npos, node = m_root;
+    bool left = false;
+    while (true) {
+        Instrumentation::add(instrumentation::NodesVisited);
+        path[depth++] = node;
+        Node & current = m_nodes[node];
+        current.m++;
+        current.m_total++;
+        current.m_box = extended(current.m_box, point);
+        left = goes_left(current, point);
+        index_type child = left ? current.m_left : current.m_right;
+        if (child == npos) {
+            break;
+        }
+        (left ? next : pred) = node;
+        node = child;
     }
+    (left ? next : pred) = node;
+
+    index_type leaf = allocate(point, !m_nodes[node].is_x);
+    (left ? m_nodes[node].m_left : m_nodes[node].m_right) = leaf;
+    m_nodes[leaf].m_next = next;
+    (pred != npos ? m_nodes[pred].m_next : m_begin) = leaf;
+    path[depth++] = leaf;
 
-    if ((point.x() < node->m_point.x() && node->is_x) || (point.y() < node->m_point.y() && !node->is_x)) {
-        return contains(node->m_left, point);
+    // rebuild the highest subtree on the path which became too unbalanced
+    for (std::size_t i = 0; i + 1 < depth; ++i) {
+        if (m_nodes[path[i + 1]].m_total > alpha * m_nodes[path[i]].m_total) {
+            balance(path, i);
+            break;
+        }
     }
-    else {
-        return contains(node->m_right, point);
+}
+
+template <class Metric, class Instrumentation>
+bool BasicPointSet<Metric, Instrumentation>::erase(const Point & point)
+{
+    index_type path[max_depth];
+    std::size_t depth = 0;
+    index_type node = m_root;
+    while (node != npos && (m_nodes[node].m_dead || m_nodes[node].m_point != point)) {
+        Instrumentation::add(instrumentation::NodesVisited);
+        path[depth++] = node;
+        node = goes_left(m_nodes[node], point) ? m_nodes[node].m_left : m_nodes[node].m_right;
     }
+    if (node == npos) {
+        return false;
+    }
+    path[depth++] = node;
+    m_nodes[node].m_dead = true;
+    for (std::size_t i = 0; i < depth; ++i) {
+        m_nodes[path[i]].m--;
+    }
+    m_size--;
+
+    // rebuild the highest subtree on the path which holds too many erased nodes
+    for (std::size_t i = 0; i < depth; ++i) {
+        const Node & current = m_nodes[path[i]];
+        if (current.m_total - current.m > max_dead_fraction * current.m_total) {
+            balance(path, i);
+            break;
+        }
+    }
+    return true;
 }
 
-std::pair<PointSet::iterator, PointSet::iterator> PointSet::range(const Rect & rect) const
+// rebuilds a perfectly balanced subtree out of the given nodes without allocating
+template <class Metric, class Instrumentation>
+typename BasicPointSet<Metric, Instrumentation>::index_type BasicPointSet<Metric, Instrumentation>::relink(index_type * first, index_type * last, bool is_x)
 {
-    std::shared_ptr<Node> range_root, range_begin, range_end;
-    if (!empty()) {
-        range(m_root, rect, range_root, range_begin, range_end);
+    if (first == last) {
+        return npos;
     }
+    index_type * mid = select_median(first, last, is_x, [this](index_type index) -> const Point & { return m_nodes[index].m_point; });
+
+    const index_type node_left = relink(first, mid, !is_x);
+    const index_type node_right = relink(mid + 1, last, !is_x);
 
-    return {iterator(range_begin, range_root), iterator(range_end)};
+    Node & current = m_nodes[*mid];
+    current.m_left = node_left;
+    current.m_right = node_right;
+    current.m = current.m_total = static_cast<index_type>(last - first);
+    current.is_x = is_x;
+    fit_box(current);
+    return *mid;
 }
 
-void PointSet::range(const std::shared_ptr<Node> & node, const Rect & rect, std::shared_ptr<Node> & range_root, std::shared_ptr<Node> & range_begin, std::shared_ptr<Node> & range_end) const
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::thread(index_type node, index_type & prev)
 {
-    if (!node) {
+    if (node == npos) {
         return;
     }
+    thread(m_nodes[node].m_left, prev);
+    (prev != npos ? m_nodes[prev].m_next : m_begin) = node;
+    prev = node;
+    thread(m_nodes[node].m_right, prev);
+}
 
-    if (rect.contains(node->m_point)) {
-        if (range_root) {
-            put(range_root, node->m_point, true, range_end, true);
-            range_begin = range_root;
-            while (range_begin->m_left) {
-                range_begin = range_begin->m_left;
-            }
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::balance(const index_type * path, std::size_t i)
+{
+    const index_type node = path[i];
+    Instrumentation::add(instrumentation::Rebalances);
+    Instrumentation::add(instrumentation::RebuiltNodes, m_nodes[node].m_total);
+
+    // the in-order neighbours of the subtree stay the same
+    index_type prev = npos;
+    for (std::size_t j = 0; j < i; ++j) {
+        if (m_nodes[path[j]].m_right == path[j + 1]) {
+            prev = path[j];
+        }
+    }
+
+    // erased nodes are dropped
+    m_scratch.clear();
+    index_type current = leftmost(node);
+    for (index_type c = m_nodes[node].m_total; c > 0; --c) {
+        if (m_nodes[current].m_dead) {
+            release(current);
         }
         else {
-            range_root = std::make_shared<Node>(node->m_point, true, range_end);
-            range_begin = range_root;
+            m_scratch.push_back(current);
         }
+        current = m_nodes[current].m_next;
     }
-
-    double value = node->is_x ? node->m_point.x() : node->m_point.y(),
-           max_dim = node->is_x ? rect.xmax() : rect.ymax(),
-           min_dim = node->is_x ? rect.xmin() : rect.ymin();
-
-    if (value < min_dim) {
-        range(node->m_right, rect, range_root, range_begin, range_end);
+    const index_type next = current;
+    const index_type dropped = m_nodes[node].m_total - static_cast<index_type>(m_scratch.size());
+    for (std::size_t j = 0; j < i; ++j) {
+        m_nodes[path[j]].m_total -= dropped;
     }
-    else if (value > max_dim) {
-        range(node->m_left, rect, range_root, range_begin, range_end);
+
+    const index_type root = relink(m_scratch.data(), m_scratch.data() + m_scratch.size(), m_nodes[node].is_x);
+    if (i == 0) {
+        m_root = root;
     }
     else {
-        range(node->m_left, rect, range_root, range_begin, range_end);
-        range(node->m_right, rect, range_root, range_begin, range_end);
+        Node & parent = m_nodes[path[i - 1]];
+        (parent.m_left == node ? parent.m_left : parent.m_right) = root;
     }
+
+    thread(root, prev);
+    (prev != npos ? m_nodes[prev].m_next : m_begin) = next;
 }
 
-PointSet::iterator PointSet::begin() const
+template <class Metric, class Instrumentation>
+bool BasicPointSet<Metric, Instrumentation>::contains(const Point & point) const
 {
-    return iterator(m_begin);
+    index_type node = m_root;
+    while (node != npos) {
+        Instrumentation::add(instrumentation::NodesVisited);
+        const Node & current = m_nodes[node];
+        if (current.m_point == point && !current.m_dead) {
+            return true;
+        }
+        node = goes_left(current, point) ? current.m_left : current.m_right;
+    }
+    return false;
 }
 
-PointSet::iterator PointSet::end() const
+template <class Metric, class Instrumentation>
+std::pair<typename BasicPointSet<Metric, Instrumentation>::iterator, typename BasicPointSet<Metric, Instrumentation>::iterator> BasicPointSet<Metric, Instrumentation>::range(const Rect & rect) const
 {
-    return iterator(m_end);
+    return {iterator(*this, rect), end()};
 }
 
-std::optional<Point> PointSet::nearest(const Point & point) const
+// Rectangles are answered in Morton order, in pieces of batch_grain, and every
+// piece collects its points in a buffer of its own. Then the counts give the
+// offsets in the caller's order and the pieces copy their points into place.
+template <class Metric, class Instrumentation>
+RangeBatch BasicPointSet<Metric, Instrumentation>::range_batch(const std::vector<Rect> & rects, std::size_t threads) const
 {
-    auto [begin, end] = nearest(point, 1);
-    if (begin != end) {
-        return *begin;
-    }
-    return {};
+    ThreadPool pool(threads);
+    return range_batch(rects, pool);
 }
 
-std::pair<PointSet::iterator, PointSet::iterator> PointSet::nearest(const Point & point, std::size_t k) const
+template <class Metric, class Instrumentation>
+RangeBatch BasicPointSet<Metric, Instrumentation>::range_batch(const std::vector<Rect> & rects, ThreadPool & pool) const
 {
-    std::shared_ptr<Node> nearest_root, nearest_begin, nearest_end;
-    std::map<double, std::shared_ptr<Node>> node_dists;
-    nearest(m_root, point, k, 0, true, node_dists, std::numeric_limits<double>::max());
+    const std::size_t count = rects.size(), pieces = (count + batch_grain - 1) / batch_grain;
+    const auto order = morton_order(rects);
+    std::vector<std::vector<Point>> found(pieces);
+    std::vector<std::size_t> start(count), found_count(count);
 
-    for (auto it = node_dists.begin(); it != node_dists.end(); it++) {
-        if (nearest_root) {
-            put(nearest_root, it->second->m_point, true, nearest_end, true);
-            nearest_begin = nearest_root;
-            while (nearest_begin->m_left) {
-                nearest_begin = nearest_begin->m_left;
+    auto for_each_piece = [&pool, pieces](const auto & f) {
+        pool.parallel_for(0, pieces, 1, [&f](std::size_t first, std::size_t last) {
+            for (std::size_t piece = first; piece < last; ++piece) {
+                f(piece);
             }
+        });
+    };
+    auto piece_end = [count](std::size_t piece) { return std::min(count, (piece + 1) * batch_grain); };
+
+    for_each_piece([&](std::size_t piece) {
+        auto & buffer = found[piece];
+        for (std::size_t r = piece * batch_grain; r < piece_end(piece); ++r) {
+            const std::size_t i = order[r];
+            start[i] = buffer.size();
+            range(m_root, rects[i], buffer);
+            found_count[i] = buffer.size() - start[i];
         }
-        else {
-            nearest_root = std::make_shared<Node>(it->second->m_point, true, nearest_end);
-            nearest_begin = nearest_root;
-        }
+    });
+
+    RangeBatch result;
+    result.offsets.resize(count + 1);
+    for (std::size_t i = 0; i < count; ++i) {
+        result.offsets[i + 1] = result.offsets[i] + found_count[i];
     }
+    result.points.resize(result.offsets[count]);
 
-    return {iterator(nearest_begin, nearest_root), iterator(nearest_end)};
+    for_each_piece([&](std::size_t piece) {
+        const auto & buffer = found[piece];
+        for (std::size_t r = piece * batch_grain; r < piece_end(piece); ++r) {
+            const std::size_t i = order[r];
+            std::copy_n(buffer.begin() + start[i], found_count[i], result.points.begin() + result.offsets[i]);
+        }
+    });
+    return result;
 }
 
-void PointSet::nearest(const std::shared_ptr<Node> & node, const Point & point, size_t k, size_t i, bool is_x, std::map<double, std::shared_ptr<Node>> & node_dists, double min_dist) const
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::range(index_type node, const Rect & rect, std::vector<Point> & out) const
 {
-    if (!node) {
+    if (node == npos || !rect.intersects(m_nodes[node].m_box)) {
         return;
     }
+    Instrumentation::add(instrumentation::NodesVisited);
+    const Node & current = m_nodes[node];
+    if (rect.contains(current.m_box)) {
+        // the subtree is a run of m_total nodes in the in-order thread
+        Instrumentation::add(instrumentation::NodesScanned, current.m_total);
+        index_type it = leftmost(node);
+        for (index_type c = current.m_total; c > 0; --c, it = m_nodes[it].m_next) {
+            if (!m_nodes[it].m_dead) {
+                out.push_back(m_nodes[it].m_point);
+            }
+        }
+        return;
+    }
+    range(current.m_left, rect, out);
+    if (!current.m_dead && rect.contains(current.m_point)) {
+        out.push_back(current.m_point);
+    }
+    range(current.m_right, rect, out);
+}
 
-    double dist = point.distance(node->m_point);
+template <class Metric, class Instrumentation>
+std::size_t BasicPointSet<Metric, Instrumentation>::count(const Rect & rect) const
+{
+    return count(m_root, rect);
+}
 
-    if (k > 0 && node_dists.size() == k && node_dists.rbegin()->first > dist) {
-        node_dists.erase(node_dists.rbegin()->first);
+template <class Metric, class Instrumentation>
+std::size_t BasicPointSet<Metric, Instrumentation>::count(index_type node, const Rect & rect) const
+{
+    if (node == npos || !rect.intersects(m_nodes[node].m_box)) {
+        return 0;
     }
-    if (node_dists.size() < k) {
-        node_dists.insert({dist, node});
+    Instrumentation::add(instrumentation::NodesVisited);
+    const Node & current = m_nodes[node];
+    if (rect.contains(current.m_box)) {
+        return current.m;
     }
+    return (!current.m_dead && rect.contains(current.m_point) ? 1 : 0) + count(current.m_left, rect) + count(current.m_right, rect);
+}
 
-    if (min_dist > dist) {
-        min_dist = dist;
+template <class Metric, class Instrumentation>
+std::pair<typename BasicPointSet<Metric, Instrumentation>::iterator, typename BasicPointSet<Metric, Instrumentation>::iterator> BasicPointSet<Metric, Instrumentation>::within(const Point & center, double radius) const
+{
+    if (radius < 0) {
+        return {end(), end()};
     }
-    i++;
+    return {iterator(*this, center, m_metric.to_comparable(radius)), end()};
+}
 
-    double sub = is_x ? node->m_point.x() - point.x() : node->m_point.y() - point.y();
-    std::shared_ptr<Node> node1(sub < 0 ? node->m_right : node->m_left);
-    std::shared_ptr<Node> node2(sub >= 0 ? node->m_right : node->m_left);
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::iterator::next_in_ball()
+{
+    while (!m_stack.empty()) {
+        const index_type node = m_stack.pop();
+        Instrumentation::add(instrumentation::NodesVisited);
+        const Node & current = m_nodes[node];
 
-    nearest(node1, point, k, i, !is_x, node_dists, min_dist);
-    if (std::abs(sub) < min_dist || i < k) {
-        nearest(node2, point, k, i, !is_x, node_dists, min_dist);
+        for (index_type child : {current.m_right, current.m_left}) {
+            if (child != npos && m_set->box_distance(m_center, m_nodes[child].m_box) <= m_radius) {
+                m_stack.push(child);
+            }
+        }
+        if (!current.m_dead && m_set->distance(m_center, current.m_point) <= m_radius) {
+            m_current = node;
+            return;
+        }
     }
+    m_current = npos;
 }
 
-std::ostream & operator<<(std::ostream & os, const PointSet & p)
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::iterator::next_in_range()
 {
-    for (auto it = p.begin(); it != p.end(); ++it) {
-        os << *it << "\n";
+    while (!m_stack.empty()) {
+        const index_type node = m_stack.pop();
+        Instrumentation::add(instrumentation::NodesVisited);
+        const Node & current = m_nodes[node];
+
+        if (current.m_right != npos && m_rect.intersects(m_nodes[current.m_right].m_box)) {
+            m_stack.push(current.m_right);
+        }
+        if (current.m_left != npos && m_rect.intersects(m_nodes[current.m_left].m_box)) {
+            m_stack.push(current.m_left);
+        }
+        if (!current.m_dead && m_rect.contains(current.m_point)) {
+            m_current = node;
+            return;
+        }
     }
-    return os << std::endl;
+    m_current = npos;
 }
 
-} // namespace kdtree
\ No newline at end of file
+template <class Metric, class Instrumentation>
+typename BasicPointSet<Metric, Instrumentation>::iterator BasicPointSet<Metric, Instrumentation>::begin() const
+{
+    return iterator(*this, m_begin);
+}
+
+template <class Metric, class Instrumentation>
+typename BasicPointSet<Metric, Instrumentation>::iterator BasicPointSet<Metric, Instrumentation>::end() const
+{
+    return iterator(*this, npos);
+}
+
+template <class Metric, class Instrumentation>
+std::optional<Point> BasicPointSet<Metric, Instrumentation>::nearest(const Point & point) const
+{
+    detail::KnnHeap heap(1);
+    nearest(m_root, point, heap);
+    const auto & result = heap.sort();
+    if (!result.empty()) {
+        return result.front().second;
+    }
+    return {};
+}
+
+template <class Metric, class Instrumentation>
+std::pair<typename BasicPointSet<Metric, Instrumentation>::iterator, typename BasicPointSet<Metric, Instrumentation>::iterator> BasicPointSet<Metric, Instrumentation>::nearest(const Point & point, std::size_t k) const
+{
+    detail::KnnHeap heap(std::min(k, size()));
+    nearest(m_root, point, heap);
+    auto points = heap.sorted_points();
+    const auto count = static_cast<index_type>(points->size());
+    return {iterator(points, 0), iterator(points, count)};
+}
+
+template <class Metric, class Instrumentation>
+NearestBatch BasicPointSet<Metric, Instrumentation>::nearest_batch(const std::vector<Point> & queries, std::size_t k, std::size_t threads) const
+{
+    ThreadPool pool(threads);
+    return nearest_batch(queries, k, pool);
+}
+
+template <class Metric, class Instrumentation>
+NearestBatch BasicPointSet<Metric, Instrumentation>::nearest_batch(const std::vector<Point> & queries, std::size_t k, ThreadPool & pool) const
+{
+    NearestBatch result;
+    const std::size_t stride = result.stride = std::min(k, size());
+    result.points.resize(queries.size() * stride);
+    result.distances.resize(queries.size() * stride);
+
+    auto answer = [this, &queries, &result, stride](std::size_t first, std::size_t last) {
+        // reused by all queries the thread answers
+        static thread_local detail::KnnHeap heap;
+        for (std::size_t i = first; i < last; ++i) {
+            heap.reset(stride);
+            nearest(m_root, queries[i], heap);
+            const auto & found = heap.sort();
+            for (std::size_t j = 0; j < found.size(); ++j) {
+                result.points[i * stride + j] = found[j].second;
+                result.distances[i * stride + j] = m_metric.from_comparable(found[j].first);
+            }
+        }
+    };
+    pool.parallel_for(0, queries.size(), batch_grain, answer);
+    return result;
+}
+
+template <class Metric, class Instrumentation>
+void BasicPointSet<Metric, Instrumentation>::nearest(index_type node, const Point & point, detail::KnnHeap & heap) const
+{
+    if (node == npos) {
+        return;
+    }
+
+    Instrumentation::add(instrumentation::NodesVisited);
+    const Node & current = m_nodes[node];
+    if (!current.m_dead) {
+        heap.push(distance(point, current.m_point), current.m_point);
+    }
+
+    const bool left_first = goes_left(current, point);
+    // the bound may shrink in the first subtree, so the second one is checked after it
+    for (index_type child : {left_first ? current.m_left : current.m_right, left_first ? current.m_right : current.m_left}) {
+        if (child != npos && box_distance(point, m_nodes[child].m_box) < heap.bound()) {
+            nearest(child, point, heap);
+        }
+    }
+}
+
+template class BasicPointSet<metric::L2>;
+template class BasicPointSet<metric::L1>;
+template class BasicPointSet<metric::Chebyshev>;
+template class BasicPointSet<metric::WeightedL2>;
+template class BasicPointSet<metric::L2, instrumentation::Counting>;
+
+} // namespace kdtree
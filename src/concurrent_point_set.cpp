@@ -0,0 +1,159 @@
+#include "concurrent_point_set.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace kdtree {
+
+template <class Metric>
+BasicConcurrentPointSet<Metric>::BasicConcurrentPointSet(const std::string & filename, Metric metric)
+    : m_pending(filename, std::move(metric))
+    , m_current(new Version(m_pending))
+{
+}
+
+template <class Metric>
+BasicConcurrentPointSet<Metric>::BasicConcurrentPointSet(std::vector<Point> points, Metric metric)
+    : m_pending(std::move(points), std::move(metric))
+    , m_current(new Version(m_pending))
+{
+}
+
+template <class Metric>
+BasicConcurrentPointSet<Metric>::~BasicConcurrentPointSet()
+{
+    delete m_current.load();
+    for (const auto & retired : m_retired) {
+        delete retired.second;
+    }
+}
+
+// The epoch is announced before the version is loaded: a version retired in an
+// epoch older than the announced one had already been replaced at that point,
+// so the reader can't see it. A reader which finds every slot taken is counted
+// before it loads the version instead.
+template <class Metric>
+typename BasicConcurrentPointSet<Metric>::Snapshot BasicConcurrentPointSet<Metric>::snapshot() const
+{
+    const std::size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (std::size_t i = 0; i < max_readers; ++i) {
+        auto & slot = m_slots[(start + i) % max_readers].epoch;
+        epoch_type free = 0;
+        if (slot.load(std::memory_order_relaxed) == 0 && slot.compare_exchange_strong(free, m_epoch.load())) {
+            return Snapshot(*this, &slot, *m_current.load());
+        }
+    }
+    m_overflow.fetch_add(1);
+    return Snapshot(*this, nullptr, *m_current.load());
+}
+
+template <class Metric>
+void BasicConcurrentPointSet<Metric>::put(const Point & point)
+{
+    std::lock_guard<std::mutex> lock(m_writer);
+    const std::size_t size = m_pending.size();
+    m_pending.put(point);
+    m_changed |= m_pending.size() != size;
+    if (m_reclaim_wanted.load(std::memory_order_relaxed)) {
+        reclaim();
+    }
+}
+
+template <class Metric>
+void BasicConcurrentPointSet<Metric>::publish()
+{
+    std::lock_guard<std::mutex> lock(m_writer);
+    if (m_changed) {
+        const Version * replaced = m_current.exchange(new Version(m_pending));
+        m_retired.emplace_back(m_epoch.fetch_add(1), replaced);
+        m_changed = false;
+    }
+    reclaim();
+}
+
+template <class Metric>
+std::size_t BasicConcurrentPointSet<Metric>::retired() const
+{
+    return m_retired_count.load();
+}
+
+// A reader clears its slot before it looks at the count, and reclaim() stores
+// the count before it looks at the slots; both are sequentially consistent, so
+// either the reader sees the retired version or reclaim() sees the free slot.
+// The same holds for the overflow count and for the oldest retired epoch.
+template <class Metric>
+void BasicConcurrentPointSet<Metric>::leave(epoch_type epoch) const
+{
+    // nothing retired, or the reader started after the oldest retired version
+    // was replaced, so whoever holds that version back holds back the rest too
+    if (m_retired_count.load() == 0 || epoch > m_oldest_retired.load()) {
+        return;
+    }
+    // a busy writer is asked to do it once it is done
+    std::unique_lock<std::mutex> lock(m_writer, std::try_to_lock);
+    if (lock.owns_lock()) {
+        reclaim();
+    }
+    else {
+        m_reclaim_wanted.store(true, std::memory_order_relaxed);
+    }
+}
+
+template <class Metric>
+void BasicConcurrentPointSet<Metric>::reclaim() const
+{
+    m_reclaim_wanted.store(false, std::memory_order_relaxed);
+    publish_retired();
+    if (m_overflow.load() != 0) {
+        return;
+    }
+    epoch_type oldest = std::numeric_limits<epoch_type>::max();
+    for (const auto & slot : m_slots) {
+        const epoch_type epoch = slot.epoch.load();
+        if (epoch != 0) {
+            oldest = std::min(oldest, epoch);
+        }
+    }
+    const auto freed = std::partition(m_retired.begin(), m_retired.end(), [oldest](const auto & retired) { return retired.first >= oldest; });
+    for (auto it = freed; it != m_retired.end(); ++it) {
+        delete it->second;
+    }
+    m_retired.erase(freed, m_retired.end());
+    publish_retired();
+}
+
+template <class Metric>
+void BasicConcurrentPointSet<Metric>::publish_retired() const
+{
+    epoch_type oldest = std::numeric_limits<epoch_type>::max();
+    for (const auto & retired : m_retired) {
+        oldest = std::min(oldest, retired.first);
+    }
+    m_oldest_retired.store(oldest);
+    m_retired_count.store(m_retired.size());
+}
+
+template <class Metric>
+std::size_t BasicConcurrentPointSet<Metric>::size() const
+{
+    return snapshot()->size();
+}
+
+template <class Metric>
+bool BasicConcurrentPointSet<Metric>::contains(const Point & point) const
+{
+    return snapshot()->contains(point);
+}
+
+template <class Metric>
+std::optional<Point> BasicConcurrentPointSet<Metric>::nearest(const Point & point) const
+{
+    return snapshot()->nearest(point);
+}
+
+template class BasicConcurrentPointSet<metric::L2>;
+template class BasicConcurrentPointSet<metric::L1>;
+template class BasicConcurrentPointSet<metric::Chebyshev>;
+template class BasicConcurrentPointSet<metric::WeightedL2>;
+
+} // namespace kdtree
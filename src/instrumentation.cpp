@@ -0,0 +1,89 @@
+#include "instrumentation.h"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+namespace kdtree::instrumentation {
+
+namespace {
+
+// the blocks of the living threads and the sum of the finished ones
+struct Registry
+{
+    std::mutex mutex;
+    std::vector<const detail::Block *> blocks;
+    Counters finished;
+};
+
+Registry & registry()
+{
+    // never destroyed, threads may finish after the static destructors ran
+    static Registry * instance = new Registry;
+    return *instance;
+}
+
+} // anonymous namespace
+
+const char * name(Counter counter)
+{
+    switch (counter) {
+    case NodesVisited:
+        return "nodes_visited";
+    case NodesScanned:
+        return "nodes_scanned";
+    case DistanceEvaluations:
+        return "distance_evaluations";
+    case Allocations:
+        return "allocations";
+    case Rebalances:
+        return "rebalances";
+    case RebuiltNodes:
+        return "rebuilt_nodes";
+    case counter_count:
+        break;
+    }
+    return "";
+}
+
+detail::Registration::Registration()
+{
+    Registry & r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.blocks.push_back(&block);
+}
+
+detail::Registration::~Registration()
+{
+    Registry & r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (std::size_t i = 0; i < counter_count; ++i) {
+        r.finished.values[i] += block.values[i].load(std::memory_order_relaxed);
+    }
+    r.blocks.erase(std::find(r.blocks.begin(), r.blocks.end(), &block));
+}
+
+Counters Counting::snapshot()
+{
+    Registry & r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    Counters result = r.finished;
+    for (const detail::Block * block : r.blocks) {
+        for (std::size_t i = 0; i < counter_count; ++i) {
+            result.values[i] += block->values[i].load(std::memory_order_relaxed);
+        }
+    }
+    return result;
+}
+
+Counters Counting::thread_snapshot()
+{
+    const detail::Block & block = local();
+    Counters result;
+    for (std::size_t i = 0; i < counter_count; ++i) {
+        result.values[i] = block.values[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+} // namespace kdtree::instrumentation
@@ -0,0 +1,51 @@
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+LatencyHistogram::Snapshot & LatencyHistogram::Snapshot::operator+=(const Snapshot & other)
+{
+    for (std::size_t i = 0; i < bucket_count; ++i) {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    max = std::max(max, other.max);
+    return *this;
+}
+
+std::uint64_t LatencyHistogram::Snapshot::percentile(double q) const
+{
+    if (total == 0) {
+        return 0;
+    }
+    const auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(total))));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return std::min(bucket_high(i), max);
+        }
+    }
+    return max;
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const
+{
+    Snapshot result;
+    for (std::size_t i = 0; i < bucket_count; ++i) {
+        result.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+        result.total += result.counts[i];
+    }
+    result.max = m_max.load(std::memory_order_relaxed);
+    return result;
+}
+
+std::uint64_t LatencyHistogram::bucket_high(std::size_t index)
+{
+    if (index < 2 * sub_buckets) {
+        return index;
+    }
+    const std::size_t shift = index / sub_buckets - 1;
+    const std::uint64_t first = index % sub_buckets + sub_buckets;
+    return (first << shift) + ((std::uint64_t(1) << shift) - 1);
+}
@@ -0,0 +1,138 @@
+#include "loader.h"
+
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+#include <charconv>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+const char * skip_blanks(const char * first, const char * last)
+{
+    while (first != last && (*first == ' ' || *first == '\t' || *first == '\r')) {
+        ++first;
+    }
+    return first;
+}
+
+// std::from_chars doesn't depend on the locale and doesn't allocate,
+// but it accepts nan and inf, which would break the ordering of the trees
+const char * parse_number(const char * first, const char * last, double & value)
+{
+    const auto [end, error] = std::from_chars(first, last, value);
+    return error == std::errc() && std::isfinite(value) ? end : nullptr;
+}
+
+// parses the lines of [first, last), returns the start of the first malformed line or nullptr
+const char * parse_points(const char * first, const char * last, std::vector<Point> & out)
+{
+    while (first != last) {
+        const char * eol = std::find(first, last, '\n');
+        const char * it = skip_blanks(first, eol);
+        if (it != eol) {
+            double x, y;
+            it = parse_number(it, eol, x);
+            it = it != nullptr ? parse_number(skip_blanks(it, eol), eol, y) : nullptr;
+            if (it == nullptr || skip_blanks(it, eol) != eol) {
+                return first;
+            }
+            out.emplace_back(x, y);
+        }
+        first = eol != last ? eol + 1 : last;
+    }
+    return nullptr;
+}
+
+std::size_t count_lines(const char * first, const char * last)
+{
+    return static_cast<std::size_t>(std::count(first, last, '\n'));
+}
+
+// chunks smaller than this aren't worth a task
+constexpr std::size_t min_chunk_size = 1 << 20;
+
+bool worth_splitting(const MappedFile & file)
+{
+    return file.size() >= 2 * min_chunk_size;
+}
+
+// parses the file in chunks on the pool, or on the calling thread without one
+std::vector<Point> parse_file(const std::string & filename, const MappedFile & file, kdtree::ThreadPool * workers)
+{
+    const char * first = file.data(), * last = first + file.size();
+    auto fail = [&](const char * line) {
+        throw std::runtime_error(filename + ":" + std::to_string(count_lines(first, line) + 1) + ": expected two numbers");
+    };
+
+    if (workers == nullptr || !worth_splitting(file)) {
+        std::vector<Point> points;
+        points.reserve(count_lines(first, last) + 1);
+        if (const char * bad = parse_points(first, last, points)) {
+            fail(bad);
+        }
+        return points;
+    }
+
+    kdtree::ThreadPool & pool = *workers;
+    // a few chunks per thread even out lines of different lengths
+    const std::size_t chunk_count = std::min(pool.size() * 4, file.size() / min_chunk_size);
+    std::vector<const char *> bounds {first};
+    for (std::size_t i = 1; i < chunk_count; ++i) {
+        const char * split = std::max(bounds.back(), first + file.size() / chunk_count * i);
+        split = std::find(split, last, '\n');
+        bounds.push_back(split != last ? split + 1 : last);
+    }
+    bounds.push_back(last);
+
+    std::vector<std::vector<Point>> parsed(chunk_count);
+    std::vector<const char *> errors(chunk_count, nullptr);
+    pool.parallel_for(0, chunk_count, 1, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            parsed[i].reserve(count_lines(bounds[i], bounds[i + 1]) + 1);
+            errors[i] = parse_points(bounds[i], bounds[i + 1], parsed[i]);
+        }
+    });
+    for (const char * bad : errors) {
+        if (bad != nullptr) {
+            fail(bad);
+        }
+    }
+
+    std::vector<std::size_t> offsets {0};
+    for (const auto & chunk : parsed) {
+        offsets.push_back(offsets.back() + chunk.size());
+    }
+    std::vector<Point> points(offsets.back());
+    pool.parallel_for(0, chunk_count, 1, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            std::copy(parsed[i].begin(), parsed[i].end(), points.begin() + offsets[i]);
+        }
+    });
+    return points;
+}
+
+} // anonymous namespace
+
+std::vector<Point> load_points(const std::string & filename, std::size_t threads)
+{
+    if (filename.empty()) {
+        return {};
+    }
+    const MappedFile file(filename);
+    if (threads == 1 || !worth_splitting(file)) {
+        return parse_file(filename, file, nullptr);
+    }
+    kdtree::ThreadPool pool(threads);
+    return parse_file(filename, file, &pool);
+}
+
+std::vector<Point> load_points(const std::string & filename, kdtree::ThreadPool & pool)
+{
+    if (filename.empty()) {
+        return {};
+    }
+    const MappedFile file(filename);
+    return parse_file(filename, file, &pool);
+}
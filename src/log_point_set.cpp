@@ -0,0 +1,160 @@
+#include "log_point_set.h"
+#include "loader.h"
+
+#include <algorithm>
+#include <memory>
+
+namespace kdtree {
+
+template <class Metric>
+BasicLogPointSet<Metric>::BasicLogPointSet(const std::string & filename, Metric metric)
+    : m_metric(std::move(metric))
+{
+    auto points = load_points(filename);
+    bulk_load(points);
+}
+
+template <class Metric>
+BasicLogPointSet<Metric>::BasicLogPointSet(std::vector<Point> points, Metric metric)
+    : m_metric(std::move(metric))
+{
+    bulk_load(points);
+}
+
+template <class Metric>
+BasicLogPointSet<Metric>::BasicLogPointSet(Metric metric)
+    : m_metric(std::move(metric))
+{
+}
+
+// the binary representation of the size tells which levels are full
+template <class Metric>
+void BasicLogPointSet<Metric>::bulk_load(std::vector<Point> & points)
+{
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+    m_size = points.size();
+    m_levels.clear();
+
+    auto first = points.begin();
+    for (std::size_t level = 0; (m_size >> level) != 0; ++level) {
+        if ((m_size >> level) & 1) {
+            const auto last = first + (std::size_t(1) << level);
+            m_levels.push_back(std::make_shared<const Level>(std::vector<Point>(first, last), m_metric));
+            first = last;
+        }
+        else {
+            m_levels.push_back(nullptr);
+        }
+    }
+}
+
+template <class Metric>
+bool BasicLogPointSet<Metric>::empty() const
+{
+    return m_size == 0;
+}
+
+template <class Metric>
+std::size_t BasicLogPointSet<Metric>::size() const
+{
+    return m_size;
+}
+
+template <class Metric>
+void BasicLogPointSet<Metric>::put(const Point & point)
+{
+    if (contains(point)) {
+        return;
+    }
+    // the new point and the full levels below the first empty one make exactly 2^level points;
+    // the levels are replaced rather than changed, as copies of the set may share them
+    std::vector<Point> merged {point};
+    std::size_t level = 0;
+    for (; level < m_levels.size() && m_levels[level]; ++level) {
+        merged.insert(merged.end(), m_levels[level]->begin(), m_levels[level]->end());
+        m_levels[level] = nullptr;
+    }
+    auto built = std::make_shared<const Level>(std::move(merged), m_metric);
+    if (level == m_levels.size()) {
+        m_levels.push_back(std::move(built));
+    }
+    else {
+        m_levels[level] = std::move(built);
+    }
+    ++m_size;
+}
+
+template <class Metric>
+bool BasicLogPointSet<Metric>::contains(const Point & point) const
+{
+    return std::any_of(m_levels.begin(), m_levels.end(), [&point](const auto & level) { return level && level->contains(point); });
+}
+
+template <class Metric>
+std::pair<typename BasicLogPointSet<Metric>::iterator, typename BasicLogPointSet<Metric>::iterator> BasicLogPointSet<Metric>::range(const Rect & rect) const
+{
+    return {iterator(*this, 0, rect), iterator(*this, m_levels.size(), rect)};
+}
+
+template <class Metric>
+void BasicLogPointSet<Metric>::iterator::next_level(std::size_t level)
+{
+    const auto & levels = m_set->m_levels;
+    for (m_level = level; m_level < levels.size(); ++m_level) {
+        if (!levels[m_level]) {
+            continue;
+        }
+        m_current = m_rect ? levels[m_level]->range(*m_rect).first : levels[m_level]->begin();
+        if (m_current != level_end()) {
+            m_point = *m_current;
+            return;
+        }
+    }
+    m_current = level_iterator();
+}
+
+template <class Metric>
+typename BasicLogPointSet<Metric>::iterator BasicLogPointSet<Metric>::begin() const
+{
+    return iterator(*this, 0);
+}
+
+template <class Metric>
+typename BasicLogPointSet<Metric>::iterator BasicLogPointSet<Metric>::end() const
+{
+    return iterator(*this, m_levels.size());
+}
+
+template <class Metric>
+std::optional<Point> BasicLogPointSet<Metric>::nearest(const Point & point) const
+{
+    auto [first, last] = nearest(point, 1);
+    if (first != last) {
+        return *first;
+    }
+    return {};
+}
+
+// one heap is shared by all levels, so the bound found in one prunes the others;
+// the largest levels go first as they are the most likely to tighten it
+template <class Metric>
+std::pair<typename BasicLogPointSet<Metric>::iterator, typename BasicLogPointSet<Metric>::iterator> BasicLogPointSet<Metric>::nearest(const Point & point, std::size_t k) const
+{
+    detail::KnnHeap heap(std::min(k, size()));
+    for (auto it = m_levels.rbegin(); it != m_levels.rend(); ++it) {
+        if (*it) {
+            (*it)->nearest(point, heap);
+        }
+    }
+    auto points = heap.sorted_points();
+    const std::size_t count = points->size();
+    return {iterator(points, 0), iterator(points, count)};
+}
+
+template class BasicLogPointSet<metric::L2>;
+template class BasicLogPointSet<metric::L1>;
+template class BasicLogPointSet<metric::Chebyshev>;
+template class BasicLogPointSet<metric::WeightedL2>;
+
+} // namespace kdtree
@@ -1,65 +1,505 @@
+#include "latency_histogram.h"
 #include "primitives.h"
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
-void add_in_set(std::set<std::string> & s, std::string & el) {
-    s.insert(el);
+// Answers queries against the points of a file and keeps per thread latency
+// histograms of every query type. Queries are read one per line, in the format
+// 2d_tree_gen writes them:
+//
+//   contains x y
+//   range xmin ymin xmax ymax
+//   nearest x y [k]
+//
+// A line "stats" in the input, or SIGUSR1, prints the percentiles so far to
+// stderr, and they are printed once more at the end. With --trace, queries
+// slower than --slow microseconds are written to the trace file together with
+// the work the tree did for them; one in --sample of them, per thread.
+//
+//   2d_tree POINTS [--queries FILE] [--output FILE] [--threads N]
+//                  [--trace FILE] [--slow MICROSECONDS] [--sample N]
+
+namespace {
+
+struct Options
+{
+    std::string points;
+    std::string queries;
+    std::string output;
+    std::string trace;
+    std::size_t threads = 1;
+    std::uint64_t slow_ns = 1000000;
+    std::size_t sample = 1;
+};
+
+enum QueryType
+{
+    Contains,
+    Range,
+    Nearest,
+    query_type_count
+};
+
+const char * const type_names[query_type_count] = {"contains", "range", "nearest"};
+
+struct Query
+{
+    QueryType type = Contains;
+    double args[4] = {};
+    std::size_t k = 1;
+};
+
+// lines the workers take from the input at once, if that many are already there
+constexpr std::size_t batch_size = 64;
+
+// how often a report asked for with SIGUSR1 is looked for
+constexpr std::chrono::milliseconds report_poll(50);
+
+std::atomic<bool> report_requested {false};
+
+void request_report(int)
+{
+    report_requested.store(true, std::memory_order_relaxed);
+}
+
+// returns false if the line isn't a query
+bool parse_query(const std::string & line, Query & query)
+{
+    const char * it = line.data();
+    const char * const end = it + line.size();
+    auto skip_blanks = [&]() {
+        while (it != end && (*it == ' ' || *it == '\t' || *it == '\r')) {
+            ++it;
+        }
+    };
+    const char * word = it;
+    while (it != end && *it != ' ' && *it != '\t') {
+        ++it;
+    }
+    const std::string type(word, it);
+    if (type == "contains") {
+        query.type = Contains;
+    }
+    else if (type == "range") {
+        query.type = Range;
+    }
+    else if (type == "nearest") {
+        query.type = Nearest;
+    }
+    else {
+        return false;
+    }
+    const std::size_t count = query.type == Range ? 4 : 2;
+    for (std::size_t i = 0; i < count; ++i) {
+        skip_blanks();
+        const auto [ptr, error] = std::from_chars(it, end, query.args[i]);
+        if (error != std::errc()) {
+            return false;
+        }
+        it = ptr;
+    }
+    query.k = 1;
+    skip_blanks();
+    if (query.type == Nearest && it != end) {
+        const auto [ptr, error] = std::from_chars(it, end, query.k);
+        if (error != std::errc()) {
+            return false;
+        }
+        it = ptr;
+        skip_blanks();
+    }
+    return it == end;
+}
+
+// the lines of the input, handed out to the workers in batches
+class Input
+{
+public:
+    explicit Input(std::istream & in)
+        : m_in(in)
+    {
+    }
+
+    // Fills the batch with numbered lines, returns false at the end of the input.
+    // Waits only for the first line, so that a query typed or piped in alone is
+    // answered without waiting for more.
+    bool next(std::vector<std::pair<std::size_t, std::string>> & batch)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        batch.clear();
+        std::string line;
+        while (batch.size() < batch_size && (batch.empty() || m_in.rdbuf()->in_avail() > 0) && std::getline(m_in, line)) {
+            batch.emplace_back(++m_line, std::move(line));
+        }
+        return !batch.empty();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::istream & m_in;
+    std::size_t m_line = 0;
+};
+
+// what a worker records, only the worker writes it
+struct Recorder
+{
+    LatencyHistogram histograms[query_type_count];
+    std::size_t slow = 0;
+    // the points a query found, reused so that the latency doesn't include growing it
+    std::vector<Point> found;
+};
+
+// the text as a JSON string
+std::string json_string(const std::string & text)
+{
+    std::string result = "\"";
+    for (const char c : text) {
+        switch (c) {
+        case '"':
+            result += "\\\"";
+            break;
+        case '\\':
+            result += "\\\\";
+            break;
+        case '\n':
+            result += "\\n";
+            break;
+        case '\r':
+            result += "\\r";
+            break;
+        case '\t':
+            result += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                result += escaped;
+            }
+            else {
+                result += c;
+            }
+        }
+    }
+    return result + '"';
+}
+
+class Server
+{
+public:
+    Server(const Options & options, std::ostream * output, std::ostream * trace)
+        : m_options(options)
+        , m_output(output)
+        , m_trace(trace)
+    {
+        for (std::size_t i = 0; i < std::max<std::size_t>(options.threads, 1); ++i) {
+            m_recorders.push_back(std::make_unique<Recorder>());
+        }
+    }
+
+    template <class Set>
+    void run(const Set & set, Input & input)
+    {
+        // reports on SIGUSR1 even while the workers wait for input
+        bool done = false;
+        std::thread reporter([this, &done]() {
+            std::unique_lock<std::mutex> lock(m_done_mutex);
+            while (!m_done.wait_for(lock, report_poll, [&done]() { return done; })) {
+                if (report_requested.exchange(false, std::memory_order_relaxed)) {
+                    report();
+                }
+            }
+        });
+        std::vector<std::thread> workers;
+        for (std::size_t i = 1; i < m_recorders.size(); ++i) {
+            workers.emplace_back([this, &set, &input, i]() { work(set, input, *m_recorders[i]); });
+        }
+        work(set, input, *m_recorders[0]);
+        for (auto & worker : workers) {
+            worker.join();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_done_mutex);
+            done = true;
+        }
+        m_done.notify_one();
+        reporter.join();
+        report();
+    }
+
+    void report()
+    {
+        std::lock_guard<std::mutex> lock(m_report);
+        std::cerr << "type          count        p50_ns        p99_ns       p999_ns        max_ns\n";
+        for (std::size_t type = 0; type < query_type_count; ++type) {
+            LatencyHistogram::Snapshot total;
+            for (const auto & recorder : m_recorders) {
+                total += recorder->histograms[type].snapshot();
+            }
+            char line[128];
+            std::snprintf(line, sizeof(line), "%-8s %10llu %13llu %13llu %13llu %13llu\n", type_names[type], static_cast<unsigned long long>(total.total), static_cast<unsigned long long>(total.percentile(.5)), static_cast<unsigned long long>(total.percentile(.99)), static_cast<unsigned long long>(total.percentile(.999)), static_cast<unsigned long long>(total.max));
+            std::cerr << line;
+        }
+        std::cerr.flush();
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    const Options & m_options;
+    std::ostream * m_output;
+    std::ostream * m_trace;
+    std::vector<std::unique_ptr<Recorder>> m_recorders;
+    std::mutex m_write;
+    std::mutex m_report;
+    std::mutex m_done_mutex;
+    std::condition_variable m_done;
+
+    template <class Set>
+    void work(const Set & set, Input & input, Recorder & recorder)
+    {
+        std::vector<std::pair<std::size_t, std::string>> batch;
+        std::string answers;
+        while (input.next(batch)) {
+            answers.clear();
+            for (const auto & [number, line] : batch) {
+                if (line == "stats") {
+                    report();
+                    continue;
+                }
+                Query query;
+                if (!parse_query(line, query)) {
+                    if (!line.empty()) {
+                        std::lock_guard<std::mutex> lock(m_write);
+                        std::cerr << "line " << number << ": not a query" << std::endl;
+                    }
+                    continue;
+                }
+                answer(set, query, number, line, recorder, answers);
+            }
+            if (m_output != nullptr && !answers.empty()) {
+                std::lock_guard<std::mutex> lock(m_write);
+                *m_output << answers << std::flush;
+            }
+        }
+    }
+
+    // the counters of the calling thread if the set counts its work, zeros otherwise
+    template <class Set>
+    static kdtree::instrumentation::Counters work_so_far()
+    {
+        if constexpr (Set::instrumentation_type::enabled) {
+            return Set::instrumentation_type::thread_snapshot();
+        }
+        else {
+            return {};
+        }
+    }
+
+    template <class Set>
+    void answer(const Set & set, const Query & query, std::size_t number, const std::string & line, Recorder & recorder, std::string & answers)
+    {
+        const auto before = m_trace != nullptr ? work_so_far<Set>() : kdtree::instrumentation::Counters();
+        std::vector<Point> & found = recorder.found;
+        found.clear();
+        bool hit = false;
+        const auto start = Clock::now();
+        switch (query.type) {
+        case Contains:
+            hit = set.contains(Point(query.args[0], query.args[1]));
+            break;
+        case Range: {
+            auto [first, last] = set.range(Rect(Point(query.args[0], query.args[1]), Point(query.args[2], query.args[3])));
+            found.assign(first, last);
+            break;
+        }
+        case Nearest: {
+            auto [first, last] = set.nearest(Point(query.args[0], query.args[1]), query.k);
+            found.assign(first, last);
+            break;
+        }
+        case query_type_count:
+            break;
+        }
+        const auto latency = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+        recorder.histograms[query.type].record(latency);
+
+        if (m_trace != nullptr && latency >= m_options.slow_ns && recorder.slow++ % m_options.sample == 0) {
+            trace(query, number, line, latency, query.type == Contains ? (hit ? 1 : 0) : found.size(), work_so_far<Set>() - before);
+        }
+        if (m_output != nullptr) {
+            answers += std::to_string(number);
+            answers += ':';
+            if (query.type == Contains) {
+                answers += hit ? " true" : " false";
+            }
+            for (const auto & point : found) {
+                // enough digits to read back the same doubles
+                char text[64];
+                std::snprintf(text, sizeof(text), " %.17g %.17g", point.x(), point.y());
+                answers += text;
+            }
+            answers += '\n';
+        }
+    }
+
+    void trace(const Query & query, std::size_t number, const std::string & line, std::uint64_t latency, std::size_t results, const kdtree::instrumentation::Counters & work)
+    {
+        namespace instrumentation = kdtree::instrumentation;
+        std::lock_guard<std::mutex> lock(m_write);
+        *m_trace << "{\"line\": " << number << ", \"type\": \"" << type_names[query.type] << "\", \"query\": " << json_string(line)
+                 << ", \"latency_ns\": " << latency << ", \"results\": " << results;
+        for (std::size_t i = 0; i < instrumentation::counter_count; ++i) {
+            const auto counter = static_cast<instrumentation::Counter>(i);
+            *m_trace << ", \"" << instrumentation::name(counter) << "\": " << work[counter];
+        }
+        *m_trace << "}\n";
+    }
+};
+
+void usage(std::ostream & out)
+{
+    out << "usage: 2d_tree POINTS [--queries FILE] [--output FILE] [--threads N]\n"
+           "                      [--trace FILE] [--slow MICROSECONDS] [--sample N]\n";
 }
 
-int main()
+// a threshold in microseconds, as nanoseconds, saturated at the largest one representable
+std::uint64_t parse_slow(const std::string & value)
 {
+    double microseconds = 0;
+    const char * end = value.data() + value.size();
+    const auto [ptr, error] = std::from_chars(value.data(), end, microseconds);
+    if (error != std::errc() || ptr != end || !std::isfinite(microseconds) || microseconds < 0) {
+        throw std::runtime_error("invalid value of --slow: " + value);
+    }
+    const double nanoseconds = microseconds * 1000.;
+    constexpr auto max = std::numeric_limits<std::uint64_t>::max();
+    // max + 1, the least double which doesn't convert
+    constexpr double limit = 2. * static_cast<double>(std::uint64_t{1} << 63);
+    return nanoseconds < limit ? static_cast<std::uint64_t>(nanoseconds) : max;
+}
+
+Options parse(int argc, char ** argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string name = argv[i];
+        if (name.rfind("--", 0) != 0) {
+            if (!options.points.empty()) {
+                throw std::runtime_error("more than one points file");
+            }
+            options.points = name;
+            continue;
+        }
+        if (i + 1 == argc) {
+            throw std::runtime_error("missing value of " + name);
+        }
+        const std::string value = argv[++i];
+        if (name == "--queries") {
+            options.queries = value;
+        }
+        else if (name == "--output") {
+            options.output = value;
+        }
+        else if (name == "--threads") {
+            options.threads = std::stoull(value);
+        }
+        else if (name == "--trace") {
+            options.trace = value;
+        }
+        else if (name == "--slow") {
+            options.slow_ns = parse_slow(value);
+        }
+        else if (name == "--sample") {
+            options.sample = std::max<std::size_t>(std::stoull(value), 1);
+        }
+        else {
+            throw std::runtime_error("unknown option " + name);
+        }
+    }
+    if (options.points.empty()) {
+        throw std::runtime_error("no points file");
+    }
+    return options;
+}
+
+std::unique_ptr<std::ofstream> open(const std::string & filename)
+{
+    if (filename.empty()) {
+        return nullptr;
+    }
+    auto file = std::make_unique<std::ofstream>(filename);
+    if (!*file) {
+        throw std::runtime_error("cannot open " + filename);
+    }
+    return file;
+}
 
+// the tree counts its work only when there is a trace to write it to
+template <class Set>
+void serve(const Options & options)
+{
+    const Set set(options.points, {}, options.threads);
+    std::ifstream file;
+    if (!options.queries.empty()) {
+        file.open(options.queries);
+        if (!file) {
+            throw std::runtime_error("cannot open " + options.queries);
+        }
+    }
+    Input input(options.queries.empty() ? std::cin : file);
+    const auto output = open(options.output);
+    const auto trace = open(options.trace);
+
+    Server server(options, output.get(), trace.get());
+    server.run(set, input);
+}
+
+} // anonymous namespace
+
+int main(int argc, char ** argv)
+{
+    Options options;
+    try {
+        options = parse(argc, argv);
+    }
+    catch (const std::exception & e) {
+        std::cerr << e.what() << std::endl;
+        usage(std::cerr);
+        return 2;
+    }
+#ifdef SIGUSR1
+    std::signal(SIGUSR1, request_report);
+#endif
+    // std::cin buffers its own input then, so that Input can tell how much has arrived
+    std::ios::sync_with_stdio(false);
 
-//    kdtree::PointSet ps1;
-//    std::cout << "main";
-//    ps1.put(Point(2,2));
-//    std::cout << ps1.size() << " " << *ps1.begin() << std::endl;
-//    std::set<std::string> strings;
-//    std::string s = "asdlf";
-//    add_in_set(strings, s);
-//    s = "";
-//    std::cout << *strings.begin();
-//    std::set<double> my_set;
-//    my_set.insert(1.);
-//    my_set.insert(2.);
-//    my_set.insert(3.);
-//    my_set.erase(--my_set.end());
-//    for(auto elem: my_set) {
-//        std::cout << elem << " ";
-//    }
-//    std::cout << *my_set.rbegin();
-
-    kdtree::PointSet ps1("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
-//    std::cout << ps1.size() << std::endl;
-    std::cout << ps1 << std::endl;
-//    //    std::cout << ps1.contains(Point(0.753, 0.943)) << std::endl;
-    //    Rect r1 = Rect(Point(0.634, 0.276), Point(.818, .42));
-    //    std::cout << std::boolalpha << r1.contains(Point(0.815, 0.839));
-    //    Point point(.386, .759);
-    //    auto range = ps1.nearest(point, 210);
-    //    std::cout << *(range.first);
-    //    int size = 0;
-    //    for(auto it = range.first; it != range.second; it++) {
-    //        std::cout << *it << " ";
-    //        size++;
-    //    }
-    //    std::cout << size << std::endl;
-    //    auto range = ps1.nearest(Point(.386, .759), 0);
-    //    auto it1 = rbtree::PointSet::iterator();
-    //    it1 = ps1.nearest(Point(.386, .759), 0).first;
-    //    std::cout << std::boolalpha << (Point(9, 7) == Point(1, 2));
-    //    ps1.put(Point(1, 2));
-    //    ps1.put(Point(3, 4));
-    //    std::cout << ps1 << std::endl;
-    //    std::cout << std::boolalpha << ps1.contains(Point(1, 2)) << " " << ps1.contains(Point(7, 7));
-    //    std::cout << ps1.nearest(Point(7, 8)).value() << std::endl;
-
-    //    Point p1(1, 2), p2(1, 2), p3(4, 6), p4(13, 7);
-    //    p2 = p1;
-    //    Rect r1(p1, p3), r2(p1, p4);
-    //    std::cout << r1 << std::endl << r2 << std::endl << std::boolalpha
-    //              << r2.contains(p3) << " " << r2.xmin() << " " << r2.ymin()
-    //              << " " << r2.xmax() << " " << r2.ymax() << r1.intersects(r2) << r2.intersects(r1) << std::endl;
-    //    std::cout << p1 << " " << p2 << " " << p3 << " "
-    //              << (p1 == p2) << " " << p2.distance(p3) << " " << p3.distance(p2) << std::endl;
+    try {
+        if (options.trace.empty()) {
+            serve<kdtree::PointSet>(options);
+        }
+        else {
+            serve<kdtree::CountingPointSet>(options);
+        }
+    }
+    catch (const std::exception & e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
 }
@@ -0,0 +1,88 @@
+#include "mapped_file.h"
+
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPED_FILE_MMAP 1
+#else
+#include <fstream>
+#include <iterator>
+#endif
+
+MappedFile::MappedFile(const std::string & filename, Access access)
+{
+#ifdef MAPPED_FILE_MMAP
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + filename);
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("cannot stat " + filename);
+    }
+    if (!S_ISREG(info.st_mode)) {
+        // a pipe or a device has no size to map, read it to the end instead
+        char chunk[1 << 16];
+        for (;;) {
+            const ssize_t count = ::read(fd, chunk, sizeof(chunk));
+            if (count < 0) {
+                ::close(fd);
+                throw std::runtime_error("cannot read " + filename);
+            }
+            if (count == 0) {
+                break;
+            }
+            m_buffer.insert(m_buffer.end(), chunk, chunk + count);
+        }
+        ::close(fd);
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+        return;
+    }
+    m_size = static_cast<std::size_t>(info.st_size);
+    if (m_size != 0) {
+        void * data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("cannot map " + filename);
+        }
+        ::madvise(data, m_size, access == Access::Sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        m_data = static_cast<const char *>(data);
+        m_mapped = true;
+    }
+    ::close(fd);
+#else
+    static_cast<void>(access);
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("cannot open " + filename);
+    }
+    m_buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef MAPPED_FILE_MMAP
+    if (m_mapped) {
+        ::munmap(const_cast<char *>(m_data), m_size);
+    }
+#endif
+}
+
+const char * MappedFile::data() const
+{
+    return m_data;
+}
+
+std::size_t MappedFile::size() const
+{
+    return m_size;
+}
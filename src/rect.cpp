@@ -23,21 +23,21 @@ double Rect::ymax() const
 }
 double Rect::distance(const Point & p) const
 {
-    double left, top, right, bottom, result;
-    left = p.x() < xmin() ? xmin() - p.x() : DBL_MAX;
-    top = p.y() > ymax() ? p.y() - ymax() : DBL_MAX;
-    right = p.x() > xmax() ? p.x() - xmax() : DBL_MAX;
-    bottom = p.y() < ymin() ? ymin() - p.y() : DBL_MAX;
-    result = std::min(std::min(left, top), std::min(right, bottom));
-    return result < DBL_MAX ? result : 0;
+    double dx = std::max({xmin() - p.x(), 0., p.x() - xmax()}),
+           dy = std::max({ymin() - p.y(), 0., p.y() - ymax()});
+    return std::hypot(dx, dy);
 }
 bool Rect::contains(const Point & p) const
 {
     return p.x() >= xmin() && p.x() <= xmax() && p.y() >= ymin() && p.y() <= ymax();
 }
+bool Rect::contains(const Rect & r) const
+{
+    return r.xmin() >= xmin() && r.xmax() <= xmax() && r.ymin() >= ymin() && r.ymax() <= ymax();
+}
 bool Rect::intersects(const Rect & r) const
 {
-    return r.contains(left_bottom) || r.contains(right_top) || contains(r.left_bottom) || contains(r.right_top);
+    return r.xmin() <= xmax() && xmin() <= r.xmax() && r.ymin() <= ymax() && ymin() <= r.ymax();
 }
 
 std::ostream & operator<<(std::ostream & strm, const Rect & r)
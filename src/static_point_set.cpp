@@ -0,0 +1,377 @@
+#include "static_point_set.h"
+
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace kdtree {
+
+namespace {
+
+// The leaf kernels below are branch-free loops over the coordinate arrays of
+// at most max_bucket_size points. The comparisons are done two points at a time
+// with SSE2, which every x86-64 CPU has, as compilers don't vectorise loops
+// packing comparison results into a bit mask; the remaining point and other
+// targets take the scalar loop. Distances need no mask and are vectorised by
+// the compiler.
+
+std::uint64_t scan_rect(const double * x, const double * y, std::size_t count, const Rect & rect)
+{
+    const double xmin = rect.xmin(), xmax = rect.xmax(), ymin = rect.ymin(), ymax = rect.ymax();
+    std::uint64_t mask = 0;
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    const __m128d lo_x = _mm_set1_pd(xmin), hi_x = _mm_set1_pd(xmax), lo_y = _mm_set1_pd(ymin), hi_y = _mm_set1_pd(ymax);
+    for (; i + 2 <= count; i += 2) {
+        const __m128d vx = _mm_loadu_pd(x + i), vy = _mm_loadu_pd(y + i);
+        const __m128d inside = _mm_and_pd(_mm_and_pd(_mm_cmpge_pd(vx, lo_x), _mm_cmple_pd(vx, hi_x)), _mm_and_pd(_mm_cmpge_pd(vy, lo_y), _mm_cmple_pd(vy, hi_y)));
+        mask |= static_cast<std::uint64_t>(_mm_movemask_pd(inside)) << i;
+    }
+#endif
+    for (; i < count; ++i) {
+        mask |= static_cast<std::uint64_t>((x[i] >= xmin) & (x[i] <= xmax) & (y[i] >= ymin) & (y[i] <= ymax)) << i;
+    }
+    return mask;
+}
+
+template <class Metric>
+void scan_distance(const double * x, const double * y, std::size_t count, const Point & point, const Metric & metric, double * dist)
+{
+    const double px = point.x(), py = point.y();
+    for (std::size_t i = 0; i < count; ++i) {
+        dist[i] = metric(std::abs(x[i] - px), std::abs(y[i] - py));
+    }
+}
+
+// the same tolerance as Point::operator==
+bool scan_equal(const double * x, const double * y, std::size_t count, const Point & point)
+{
+    const double px = point.x(), py = point.y(), eps = std::numeric_limits<double>::epsilon();
+    bool found = false;
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    // clearing the sign bit gives the absolute value
+    const __m128d sign = _mm_set1_pd(-0.), vpx = _mm_set1_pd(px), vpy = _mm_set1_pd(py), veps = _mm_set1_pd(eps);
+    __m128d equal = _mm_setzero_pd();
+    for (; i + 2 <= count; i += 2) {
+        const __m128d dx = _mm_andnot_pd(sign, _mm_sub_pd(_mm_loadu_pd(x + i), vpx)), dy = _mm_andnot_pd(sign, _mm_sub_pd(_mm_loadu_pd(y + i), vpy));
+        equal = _mm_or_pd(equal, _mm_and_pd(_mm_cmplt_pd(dx, veps), _mm_cmplt_pd(dy, veps)));
+    }
+    found = _mm_movemask_pd(equal) != 0;
+#endif
+    for (; i < count; ++i) {
+        found |= (std::abs(x[i] - px) < eps) & (std::abs(y[i] - py) < eps);
+    }
+    return found;
+}
+
+unsigned lowest_bit(std::uint64_t mask)
+{
+#if defined(__GNUC__)
+    return static_cast<unsigned>(__builtin_ctzll(mask));
+#else
+    unsigned bit = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+// Layout of an index file: the header, then the arrays at the offsets it gives,
+// each of them aligned to a cache line.
+struct IndexHeader
+{
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t bucket_size;
+    // zero, it takes the place of the padding before size
+    std::uint32_t reserved;
+    std::uint64_t size;
+    std::uint64_t x, y;
+};
+
+constexpr char index_magic[4] = {'K', 'D', '2', 'I'};
+constexpr std::uint32_t index_version = 2;
+constexpr std::uint64_t index_alignment = 64;
+
+std::uint64_t aligned(std::uint64_t offset)
+{
+    return (offset + index_alignment - 1) / index_alignment * index_alignment;
+}
+
+} // anonymous namespace
+
+template <class Metric>
+BasicStaticPointSet<Metric>::BasicStaticPointSet(Metric metric, std::size_t bucket_size)
+    : m_metric(std::move(metric))
+    , m_bucket_size(static_cast<index_type>(std::clamp<std::size_t>(bucket_size, 1, max_bucket_size)))
+{
+}
+
+template <class Metric>
+BasicStaticPointSet<Metric>::BasicStaticPointSet(std::vector<Point> points, Metric metric, std::size_t bucket_size)
+    : BasicStaticPointSet(std::move(metric), bucket_size)
+{
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+    m_size = static_cast<index_type>(points.size());
+    build(points, root());
+
+    auto arrays = std::make_shared<Arrays>();
+    arrays->x.reserve(points.size());
+    arrays->y.reserve(points.size());
+    for (const auto & point : points) {
+        arrays->x.push_back(point.x());
+        arrays->y.push_back(point.y());
+    }
+    m_x = arrays->x.data();
+    m_y = arrays->y.data();
+    m_storage = std::move(arrays);
+}
+
+template <class Metric>
+BasicStaticPointSet<Metric>::BasicStaticPointSet(const BasicPointSet<Metric> & ps, std::size_t bucket_size)
+    : BasicStaticPointSet(std::vector<Point>(ps.begin(), ps.end()), ps.metric(), bucket_size)
+{
+}
+
+template <class Metric>
+void BasicStaticPointSet<Metric>::save(const std::string & path) const
+{
+    IndexHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::copy(std::begin(index_magic), std::end(index_magic), header.magic);
+    header.version = index_version;
+    header.bucket_size = m_bucket_size;
+    header.size = m_size;
+    header.x = aligned(sizeof(header));
+    header.y = aligned(header.x + m_size * sizeof(double));
+
+    std::ofstream out(path, std::ios::binary);
+    std::uint64_t offset = 0;
+    auto write = [&out, &offset](std::uint64_t at, const void * data, std::size_t size) {
+        for (; offset < at; ++offset) {
+            out.put('\0');
+        }
+        out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+        offset += size;
+    };
+    write(0, &header, sizeof(header));
+    write(header.x, m_x, m_size * sizeof(double));
+    write(header.y, m_y, m_size * sizeof(double));
+    if (!out.flush()) {
+        throw std::runtime_error("cannot write " + path);
+    }
+}
+
+template <class Metric>
+BasicStaticPointSet<Metric> BasicStaticPointSet<Metric>::open(const std::string & path, Metric metric)
+{
+    auto file = std::make_shared<const MappedFile>(path, MappedFile::Access::Random);
+    auto fail = [&path](const char * what) {
+        throw std::runtime_error(path + ": " + what);
+    };
+    IndexHeader header;
+    if (file->size() < sizeof(header)) {
+        fail("not a k-d tree index");
+    }
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (!std::equal(std::begin(index_magic), std::end(index_magic), header.magic)) {
+        fail("not a k-d tree index");
+    }
+    if (header.version != index_version || header.reserved != 0) {
+        fail("unsupported index version");
+    }
+    auto fits = [&file, &header](std::uint64_t offset, std::uint64_t element_size) {
+        return offset % index_alignment == 0 && offset <= file->size() && header.size <= (file->size() - offset) / element_size;
+    };
+    if (header.bucket_size < 1 || header.bucket_size > max_bucket_size || header.size >= std::numeric_limits<index_type>::max() ||
+        !fits(header.x, sizeof(double)) || !fits(header.y, sizeof(double))) {
+        fail("damaged index");
+    }
+
+    BasicStaticPointSet result(std::move(metric), header.bucket_size);
+    result.m_size = static_cast<index_type>(header.size);
+    result.m_x = reinterpret_cast<const double *>(file->data() + header.x);
+    result.m_y = reinterpret_cast<const double *>(file->data() + header.y);
+    result.m_storage = std::move(file);
+    return result;
+}
+
+template <class Metric>
+void BasicStaticPointSet<Metric>::build(std::vector<Point> & points, const Subtree & subtree) const
+{
+    if (is_leaf(subtree)) {
+        return;
+    }
+    const index_type mid = middle(subtree);
+    const auto first = points.begin();
+    const bool is_x = subtree.is_x;
+    std::nth_element(first + subtree.first, first + mid, first + subtree.last, [is_x](const Point & a, const Point & b) { return less(a, b, is_x); });
+    build(points, {subtree.first, mid, !is_x});
+    build(points, {mid + 1, subtree.last, !is_x});
+}
+
+template <class Metric>
+bool BasicStaticPointSet<Metric>::empty() const
+{
+    return m_size == 0;
+}
+
+template <class Metric>
+std::size_t BasicStaticPointSet<Metric>::size() const
+{
+    return m_size;
+}
+
+template <class Metric>
+std::size_t BasicStaticPointSet<Metric>::bucket_size() const
+{
+    return m_bucket_size;
+}
+
+template <class Metric>
+bool BasicStaticPointSet<Metric>::contains(const Point & point) const
+{
+    Subtree subtree = root();
+    while (!is_leaf(subtree)) {
+        const index_type mid = middle(subtree);
+        const Point current = this->point(mid);
+        if (current == point) {
+            return true;
+        }
+        if (less(point, current, subtree.is_x)) {
+            subtree = {subtree.first, mid, !subtree.is_x};
+        }
+        else {
+            subtree = {mid + 1, subtree.last, !subtree.is_x};
+        }
+    }
+    return scan_equal(m_x + subtree.first, m_y + subtree.first, subtree.last - subtree.first, point);
+}
+
+template <class Metric>
+std::pair<typename BasicStaticPointSet<Metric>::iterator, typename BasicStaticPointSet<Metric>::iterator> BasicStaticPointSet<Metric>::range(const Rect & rect) const
+{
+    return {iterator(*this, rect), iterator()};
+}
+
+template <class Metric>
+void BasicStaticPointSet<Metric>::iterator::next_in_range()
+{
+    while (m_matches == 0 && !m_stack.empty()) {
+        const Subtree subtree = m_stack.pop();
+        if (m_set->is_leaf(subtree)) {
+            m_leaf = subtree.first;
+            m_matches = scan_rect(m_set->m_x + subtree.first, m_set->m_y + subtree.first, subtree.last - subtree.first, m_rect);
+            continue;
+        }
+        const index_type mid = middle(subtree);
+        const Point current = m_set->point(mid);
+
+        double value = subtree.is_x ? current.x() : current.y(),
+               max_dim = subtree.is_x ? m_rect.xmax() : m_rect.ymax(),
+               min_dim = subtree.is_x ? m_rect.xmin() : m_rect.ymin();
+
+        // both halves may hold coordinates equal to value
+        if (value <= max_dim) {
+            m_stack.push({mid + 1, subtree.last, !subtree.is_x});
+        }
+        if (min_dim <= value) {
+            m_stack.push({subtree.first, mid, !subtree.is_x});
+        }
+        if (m_rect.contains(current)) {
+            m_current = mid;
+            return;
+        }
+    }
+    if (m_matches != 0) {
+        m_current = m_leaf + lowest_bit(m_matches);
+        m_matches &= m_matches - 1;
+        return;
+    }
+    *this = iterator();
+}
+
+template <class Metric>
+typename BasicStaticPointSet<Metric>::iterator BasicStaticPointSet<Metric>::begin() const
+{
+    return iterator(*this, 0);
+}
+
+template <class Metric>
+typename BasicStaticPointSet<Metric>::iterator BasicStaticPointSet<Metric>::end() const
+{
+    return iterator(*this, m_size);
+}
+
+template <class Metric>
+std::optional<Point> BasicStaticPointSet<Metric>::nearest(const Point & point) const
+{
+    detail::KnnHeap heap(1);
+    nearest(root(), point, heap);
+    const auto & result = heap.sort();
+    if (!result.empty()) {
+        return result.front().second;
+    }
+    return {};
+}
+
+template <class Metric>
+std::pair<typename BasicStaticPointSet<Metric>::iterator, typename BasicStaticPointSet<Metric>::iterator> BasicStaticPointSet<Metric>::nearest(const Point & point, std::size_t k) const
+{
+    detail::KnnHeap heap(std::min(k, size()));
+    nearest(root(), point, heap);
+    auto points = heap.sorted_points();
+    const std::size_t count = points->size();
+    return {iterator(points, 0), iterator(points, count)};
+}
+
+template <class Metric>
+void BasicStaticPointSet<Metric>::nearest(const Point & point, detail::KnnHeap & heap) const
+{
+    nearest(root(), point, heap);
+}
+
+template <class Metric>
+void BasicStaticPointSet<Metric>::nearest(const Subtree & subtree, const Point & point, detail::KnnHeap & heap) const
+{
+    if (is_leaf(subtree)) {
+        const std::size_t count = subtree.last - subtree.first;
+        double dist[max_bucket_size];
+        scan_distance(m_x + subtree.first, m_y + subtree.first, count, point, m_metric, dist);
+        for (std::size_t i = 0; i < count; ++i) {
+            if (dist[i] < heap.bound()) {
+                heap.push(dist[i], this->point(subtree.first + i));
+            }
+        }
+        return;
+    }
+    const index_type mid = middle(subtree);
+    const Point current = this->point(mid);
+    heap.push(distance(point, current), current);
+
+    const Subtree left {subtree.first, mid, !subtree.is_x}, right {mid + 1, subtree.last, !subtree.is_x};
+    const double sub = subtree.is_x ? point.x() - current.x() : point.y() - current.y();
+    nearest(sub < 0 ? left : right, point, heap);
+    // the other side is at least |sub| away along the splitting axis
+    if (axis_distance(sub, subtree.is_x) < heap.bound()) {
+        nearest(sub < 0 ? right : left, point, heap);
+    }
+}
+
+template class BasicStaticPointSet<metric::L2>;
+template class BasicStaticPointSet<metric::L1>;
+template class BasicStaticPointSet<metric::Chebyshev>;
+template class BasicStaticPointSet<metric::WeightedL2>;
+
+} // namespace kdtree
@@ -0,0 +1,143 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+namespace kdtree {
+
+namespace {
+
+// the pool the current thread works for and the index of its queue there
+thread_local const ThreadPool * t_pool = nullptr;
+thread_local std::size_t t_index = 0;
+
+} // anonymous namespace
+
+ThreadPool::ThreadPool(std::size_t threads)
+    : m_queues(std::max<std::size_t>(threads != 0 ? threads : std::thread::hardware_concurrency(), 1))
+{
+    m_workers.reserve(m_queues.size() - 1);
+    for (std::size_t i = 0; i + 1 < m_queues.size(); ++i) {
+        m_workers.emplace_back([this, i]() { work(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sleep);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto & worker : m_workers) {
+        worker.join();
+    }
+}
+
+std::size_t ThreadPool::size() const
+{
+    return m_queues.size();
+}
+
+ThreadPool::Queue & ThreadPool::own_queue()
+{
+    return m_queues[t_pool == this ? t_index : m_queues.size() - 1];
+}
+
+void ThreadPool::push(Task & task)
+{
+    {
+        Queue & queue = own_queue();
+        std::lock_guard<std::mutex> lock(queue.m_mutex);
+        queue.m_tasks.push_back(&task);
+    }
+    ++m_queued;
+    if (!m_workers.empty()) {
+        // taking the lock orders the wakeup after a worker's check of m_queued
+        { std::lock_guard<std::mutex> lock(m_sleep); }
+        m_wake.notify_one();
+    }
+}
+
+ThreadPool::Task * ThreadPool::take()
+{
+    const std::size_t own = t_pool == this ? t_index : m_queues.size() - 1;
+    for (std::size_t i = 0; i < m_queues.size(); ++i) {
+        Queue & queue = m_queues[(own + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(queue.m_mutex);
+        if (queue.m_tasks.empty()) {
+            continue;
+        }
+        Task * task;
+        if (i == 0) {
+            task = queue.m_tasks.back();
+            queue.m_tasks.pop_back();
+        }
+        else {
+            task = queue.m_tasks.front();
+            queue.m_tasks.pop_front();
+        }
+        --m_queued;
+        return task;
+    }
+    return nullptr;
+}
+
+void ThreadPool::execute(Task & task)
+{
+    try {
+        task.m_run(task.m_arg);
+    }
+    catch (...) {
+        task.m_error = std::current_exception();
+    }
+    task.m_done.store(true, std::memory_order_release);
+}
+
+void ThreadPool::join(Task & task)
+{
+    // On a worker's own queue nothing forked after the task is still queued, so it
+    // is either on top or stolen. Threads outside the pool share the last queue,
+    // where other callers may have pushed tasks on top of it, so it is looked for
+    // below them as well; it is searched from the top, where it usually is.
+    {
+        Queue & queue = own_queue();
+        std::unique_lock<std::mutex> lock(queue.m_mutex);
+        const auto found = std::find(queue.m_tasks.rbegin(), queue.m_tasks.rend(), &task);
+        if (found != queue.m_tasks.rend()) {
+            queue.m_tasks.erase(std::next(found).base());
+            lock.unlock();
+            --m_queued;
+            execute(task);
+        }
+    }
+    while (!task.m_done.load(std::memory_order_acquire)) {
+        if (Task * other = take()) {
+            execute(*other);
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+    if (task.m_error) {
+        std::rethrow_exception(task.m_error);
+    }
+}
+
+void ThreadPool::work(std::size_t index)
+{
+    t_pool = this;
+    t_index = index;
+    while (true) {
+        if (Task * task = take()) {
+            execute(*task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_sleep);
+        m_wake.wait(lock, [this]() { return m_stop || m_queued > 0; });
+        if (m_stop) {
+            return;
+        }
+    }
+}
+
+} // namespace kdtree
@@ -0,0 +1,272 @@
+#include "workload.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+
+namespace workload {
+
+namespace {
+
+// independent streams of random numbers derived from one seed
+enum class Stream : std::uint64_t
+{
+    Shape,
+    Points,
+    Lookups,
+    Nearest,
+    Ranges
+};
+
+constexpr double pi = 3.14159265358979323846;
+
+class Random
+{
+public:
+    Random(std::uint64_t seed, Stream stream)
+        : m_engine(seed ^ (static_cast<std::uint64_t>(stream) + 1) * 0x9e3779b97f4a7c15)
+    {
+    }
+
+    // in [0, 1) with all 53 bits of the mantissa random
+    double uniform()
+    {
+        return static_cast<double>(m_engine() >> 11) * 0x1p-53;
+    }
+
+    std::size_t below(std::size_t n)
+    {
+        return m_engine() % n;
+    }
+
+    // Box-Muller, one value of each pair is enough here
+    double normal()
+    {
+        const double u = 1. - uniform();
+        return std::sqrt(-2. * std::log(u)) * std::cos(2. * pi * uniform());
+    }
+
+private:
+    std::mt19937_64 m_engine;
+};
+
+constexpr std::size_t cluster_count = 16;
+constexpr double cluster_sigma = .01;
+// the Zipf grid has zipf_side^2 cells, the i-th most popular gets a share of 1 / i^zipf_exponent
+constexpr std::size_t zipf_side = 64;
+constexpr double zipf_exponent = 1.2;
+// shift of the lookups that miss
+constexpr double miss_offset = 1e-9;
+// make_ranges() aims at this many points of its sample in a range
+constexpr double sample_hits = 256.;
+
+// what a distribution needs besides the stream of random numbers; it depends on
+// the seed and the size only, so the queries follow the same shape as the data
+class Shape
+{
+public:
+    Shape(Distribution distribution, std::size_t size, std::uint64_t seed)
+        : m_distribution(distribution)
+    {
+        Random random(seed, Stream::Shape);
+        switch (distribution) {
+        case Distribution::Clustered:
+            for (std::size_t i = 0; i < cluster_count; ++i) {
+                m_centers.emplace_back(random.uniform(), random.uniform());
+            }
+            break;
+        case Distribution::Zipf: {
+            double total = 0.;
+            for (std::size_t rank = 1; rank <= zipf_side * zipf_side; ++rank) {
+                total += std::pow(static_cast<double>(rank), -zipf_exponent);
+                m_weights.push_back(total);
+            }
+            for (auto & weight : m_weights) {
+                weight /= total;
+            }
+            // the popular cells are scattered over the square
+            m_cells.resize(zipf_side * zipf_side);
+            for (std::size_t i = 0; i < m_cells.size(); ++i) {
+                m_cells[i] = i;
+            }
+            for (std::size_t i = m_cells.size() - 1; i > 0; --i) {
+                std::swap(m_cells[i], m_cells[random.below(i + 1)]);
+            }
+            break;
+        }
+        case Distribution::Grid:
+            m_side = std::max<std::size_t>(1, static_cast<std::size_t>(std::ceil(std::sqrt(static_cast<double>(size)))));
+            break;
+        case Distribution::Uniform:
+        case Distribution::Collinear:
+        case Distribution::Sorted:
+            break;
+        }
+    }
+
+    Point next(Random & random) const
+    {
+        switch (m_distribution) {
+        case Distribution::Clustered: {
+            const Point & center = m_centers[random.below(m_centers.size())];
+            const double dx = random.normal(), dy = random.normal();
+            return Point(center.x() + cluster_sigma * dx, center.y() + cluster_sigma * dy);
+        }
+        case Distribution::Zipf: {
+            const auto rank = std::upper_bound(m_weights.begin(), m_weights.end(), random.uniform()) - m_weights.begin();
+            const std::size_t cell = m_cells[std::min<std::size_t>(static_cast<std::size_t>(rank), m_cells.size() - 1)];
+            const double side = static_cast<double>(zipf_side);
+            const double x = (static_cast<double>(cell % zipf_side) + random.uniform()) / side;
+            const double y = (static_cast<double>(cell / zipf_side) + random.uniform()) / side;
+            return Point(x, y);
+        }
+        case Distribution::Collinear: {
+            const double t = random.uniform();
+            return Point(t, t);
+        }
+        case Distribution::Grid: {
+            const double x = static_cast<double>(random.below(m_side)) / static_cast<double>(m_side);
+            return Point(x, static_cast<double>(random.below(m_side)) / static_cast<double>(m_side));
+        }
+        case Distribution::Uniform:
+        case Distribution::Sorted:
+            break;
+        }
+        const double x = random.uniform();
+        return Point(x, random.uniform());
+    }
+
+private:
+    Distribution m_distribution;
+    std::vector<Point> m_centers;
+    std::vector<double> m_weights;
+    std::vector<std::size_t> m_cells;
+    std::size_t m_side = 1;
+};
+
+double chebyshev(const Point & a, const Point & b)
+{
+    return std::max(std::abs(a.x() - b.x()), std::abs(a.y() - b.y()));
+}
+
+} // anonymous namespace
+
+const std::vector<Distribution> & distributions()
+{
+    static const std::vector<Distribution> all = {
+            Distribution::Uniform,
+            Distribution::Clustered,
+            Distribution::Zipf,
+            Distribution::Collinear,
+            Distribution::Grid,
+            Distribution::Sorted};
+    return all;
+}
+
+std::string name(Distribution distribution)
+{
+    switch (distribution) {
+    case Distribution::Uniform:
+        return "uniform";
+    case Distribution::Clustered:
+        return "clustered";
+    case Distribution::Zipf:
+        return "zipf";
+    case Distribution::Collinear:
+        return "collinear";
+    case Distribution::Grid:
+        return "grid";
+    case Distribution::Sorted:
+        return "sorted";
+    }
+    return {};
+}
+
+Distribution parse_distribution(const std::string & distribution)
+{
+    for (const auto candidate : distributions()) {
+        if (name(candidate) == distribution) {
+            return candidate;
+        }
+    }
+    throw std::runtime_error("unknown distribution " + distribution);
+}
+
+std::vector<Point> make_points(Distribution distribution, std::size_t count, std::uint64_t seed)
+{
+    const Shape shape(distribution, count, seed);
+    Random random(seed, Stream::Points);
+    std::vector<Point> points;
+    points.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        points.push_back(shape.next(random));
+    }
+    if (distribution == Distribution::Sorted) {
+        std::sort(points.begin(), points.end());
+    }
+    return points;
+}
+
+Queries make_queries(Distribution distribution, const std::vector<Point> & points, std::size_t count, std::size_t k, std::uint64_t seed)
+{
+    Queries queries;
+    queries.k = k;
+    if (points.empty()) {
+        return queries;
+    }
+    Random lookups(seed, Stream::Lookups);
+    queries.lookups.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const Point & point = points[lookups.below(points.size())];
+        // far enough for Point::operator==, and off the grid and the diagonal as well
+        queries.lookups.push_back(i % 2 == 0 ? point : Point(point.x() + miss_offset, point.y()));
+    }
+    const Shape shape(distribution, points.size(), seed);
+    Random nearest(seed, Stream::Nearest);
+    queries.nearest.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        queries.nearest.push_back(shape.next(nearest));
+    }
+    return queries;
+}
+
+// The half side of a square holding m points around a center is the distance
+// to its m-th nearest point under the Chebyshev metric. Searching the whole
+// data for every query would take too long at large sizes, so it is done on a
+// sample big enough to contain about sample_hits points of a range.
+std::vector<Rect> make_ranges(const std::vector<Point> & points, std::size_t count, double selectivity, std::uint64_t seed)
+{
+    std::vector<Rect> ranges;
+    if (points.empty() || count == 0) {
+        return ranges;
+    }
+    Random random(seed, Stream::Ranges);
+    const auto wanted = static_cast<std::size_t>(std::min(sample_hits / std::max(selectivity, 1e-12), 1e18));
+    std::vector<Point> sample;
+    if (wanted * 4 >= points.size()) {
+        sample = points;
+    }
+    else {
+        sample.reserve(wanted);
+        for (std::size_t i = 0; i < wanted; ++i) {
+            sample.push_back(points[random.below(points.size())]);
+        }
+    }
+    const kdtree::BasicPointSet<kdtree::metric::Chebyshev> index(std::move(sample));
+    const auto hits = std::max<std::size_t>(1, static_cast<std::size_t>(std::llround(selectivity * static_cast<double>(index.size()))));
+
+    ranges.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const Point & center = points[random.below(points.size())];
+        double radius = 0.;
+        auto [first, last] = index.nearest(center, hits);
+        for (; first != last; ++first) {
+            radius = std::max(radius, chebyshev(center, *first));
+        }
+        ranges.emplace_back(Point(center.x() - radius, center.y() - radius), Point(center.x() + radius, center.y() + radius));
+    }
+    return ranges;
+}
+
+} // namespace workload
@@ -1,11 +1,125 @@
 #include <gtest/gtest.h>
+#include "concurrent_point_set.h"
+#include "latency_histogram.h"
+#include "loader.h"
+#include "log_point_set.h"
+#include "mapped_file.h"
 #include "primitives.h"
+#include "static_point_set.h"
 #include "test_iterator.h"
+#include "thread_pool.h"
+#include "workload.h"
 
 #include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <new>
+#include <memory>
+#include <random>
 #include <fstream>
 #include <set>
+#include <sstream>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// heap allocations of the current thread and their bytes, counted by the operators new below
+thread_local std::size_t allocations = 0;
+thread_local std::size_t allocated_bytes = 0;
+
+void * counted_malloc(std::size_t size) noexcept
+{
+    ++allocations;
+    allocated_bytes += size;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+// out of line, so that gcc sees no free() of a pointer it knows came from operator new
+[[gnu::noinline]] void release(void * p) noexcept
+{
+    std::free(p);
+}
+
+} // anonymous namespace
+
+// every non-aligned form is replaced, so that each of their deletes frees what malloc gave
+void * operator new(std::size_t size)
+{
+    if (void * p = counted_malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void * operator new[](std::size_t size)
+{
+    return ::operator new(size);
+}
+
+void * operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_malloc(size);
+}
+
+void * operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_malloc(size);
+}
+
+void operator delete(void * p) noexcept
+{
+    release(p);
+}
+
+void operator delete[](void * p) noexcept
+{
+    release(p);
+}
+
+void operator delete(void * p, std::size_t) noexcept
+{
+    release(p);
+}
+
+void operator delete[](void * p, std::size_t) noexcept
+{
+    release(p);
+}
+
+void operator delete(void * p, const std::nothrow_t &) noexcept
+{
+    release(p);
+}
+
+void operator delete[](void * p, const std::nothrow_t &) noexcept
+{
+    release(p);
+}
+
+#if defined(__linux__)
+namespace {
+
+// calls of munmap() by the current thread, counted by the one below
+thread_local std::size_t unmappings = 0;
+
+} // anonymous namespace
+
+extern "C" int munmap(void * addr, std::size_t length) noexcept
+{
+    ++unmappings;
+    return static_cast<int>(::syscall(SYS_munmap, addr, length));
+}
+#endif
 
 template <typename T>
 class PointSetTest : public ::testing::Test {
@@ -84,7 +198,7 @@ class PointSetTest : public ::testing::Test {
         T m_sample;
 };
 
-using TestTypes = ::testing::Types<rbtree::PointSet, kdtree::PointSet>;
+using TestTypes = ::testing::Types<rbtree::PointSet, kdtree::PointSet, kdtree::LogPointSet>;
 TYPED_TEST_SUITE(PointSetTest, TestTypes);
 
 TEST(PointSetTest, Point)
@@ -110,17 +224,21 @@ TEST(PointSetTest, Rect)
     ASSERT_DOUBLE_EQ(r.distance(Point(2., 3.)), 1.);
     ASSERT_DOUBLE_EQ(r.distance(Point(4., 1.2)), 2.);
     ASSERT_DOUBLE_EQ(r.distance(Point(1.1, -1)), 2.);
+    ASSERT_DOUBLE_EQ(r.distance(Point(5., 6.)), 5.);
     ASSERT_TRUE(r.contains(Point(1.5, 1.5)));
     ASSERT_FALSE(r.contains(Point(.9, 1.5)));
     ASSERT_TRUE(r.intersects(Rect(Point(0., 0.), Point(1.5, 1.5))));
     ASSERT_TRUE(r.intersects(Rect(Point(0.5, 0.5), Point(3.5, 3.5))));
     ASSERT_FALSE(r.intersects(Rect(Point(2.1, 0.1), Point(3.5, 1.9))));
+    ASSERT_TRUE(r.intersects(Rect(Point(1.2, 0.), Point(1.8, 3.))));
+    ASSERT_TRUE(r.contains(Rect(Point(1.2, 1.2), Point(2., 1.8))));
+    ASSERT_FALSE(r.contains(Rect(Point(1.2, 0.), Point(1.8, 3.))));
 }
 
 TYPED_TEST(PointSetTest, ForwardIterator)
 {
-//    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
-    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+//    this->load_data("test/etc/test2.dat");
+    this->load_data("test/etc/test2.dat");
     auto & p = this->m_set;
 
     auto s1 = this->to_set(std::make_pair(p.begin(), p.end()));
@@ -187,7 +305,7 @@ TYPED_TEST(PointSetTest, PointSetBasicSearch)
 TYPED_TEST(PointSetTest, PointSetNearest0)
 {
 //    this->load_data("test/etc/test0.dat");
-this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test0.dat");
+this->load_data("test/etc/test0.dat");
     auto & p = this->m_set;
     this->check_size(5);
 
@@ -199,8 +317,8 @@ this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\et
 
 TYPED_TEST(PointSetTest, PointSetNearest1)
 {
-//    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
-this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+//    this->load_data("test/etc/test2.dat");
+this->load_data("test/etc/test2.dat");
     auto & p = this->m_set;
     this->check_size(120);
 
@@ -212,8 +330,8 @@ this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\et
 
 TYPED_TEST(PointSetTest, PointSetNearest1B)
 {
-//    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
-this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+//    this->load_data("test/etc/test2.dat");
+this->load_data("test/etc/test2.dat");
     auto & p = this->m_set;
     this->check_size(120);
 
@@ -226,7 +344,7 @@ this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\et
 TYPED_TEST(PointSetTest, PointSetRange0)
 {
 //    this->load_data("test/etc/test1.dat");
-this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test1.dat");
+this->load_data("test/etc/test1.dat");
     auto & p = this->m_set;
     this->check_size(20);
 
@@ -244,7 +362,7 @@ TYPED_TEST(PointSetTest, PointSetRange0FromFile)
 {
     using point_set_t = typename TestFixture::point_set_t;
 //    point_set_t p("test/etc/test1.dat");
-    point_set_t p("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test1.dat");
+    point_set_t p("test/etc/test1.dat");
 
     auto range = p.range(Rect(Point(0.634, 0.276), Point(.818, .42)));
 
@@ -257,8 +375,8 @@ TYPED_TEST(PointSetTest, PointSetRange0FromFile)
 
 TYPED_TEST(PointSetTest, PointSetRange1)
 {
-//    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
-    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+//    this->load_data("test/etc/test2.dat");
+    this->load_data("test/etc/test2.dat");
     auto & p = this->m_set;
     this->check_size(120);
 
@@ -281,8 +399,8 @@ TYPED_TEST(PointSetTest, PointSetRange1)
 
 TYPED_TEST(PointSetTest, PointSetRange1B)
 {
-//    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
-this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+//    this->load_data("test/etc/test2.dat");
+this->load_data("test/etc/test2.dat");
     auto & p = this->m_set;
     this->check_size(120);
 
@@ -305,8 +423,8 @@ this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\et
 
 TYPED_TEST(PointSetTest, PointSetNearestK1)
 {
-//    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
-    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+//    this->load_data("test/etc/test2.dat");
+    this->load_data("test/etc/test2.dat");
     const auto & p = this->m_set;
     this->check_size(120);
 
@@ -337,7 +455,7 @@ TYPED_TEST(PointSetTest, PointSetNearestK1)
 
 TYPED_TEST(PointSetTest, PointSetNearestK1B)
 {
-    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+    this->load_data("test/etc/test2.dat");
     auto & p = this->m_set;
     this->check_size(120);
 
@@ -368,7 +486,7 @@ TYPED_TEST(PointSetTest, PointSetNearestK1B)
 
 TYPED_TEST(PointSetTest, RangeForwardIterator)
 {
-    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+    this->load_data("test/etc/test2.dat");
     auto & p = this->m_set;
     this->check_size(120);
 
@@ -399,7 +517,7 @@ TYPED_TEST(PointSetTest, RangeForwardIterator)
 
 TYPED_TEST(PointSetTest, NearestForwardIterator)
 {
-    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+    this->load_data("test/etc/test2.dat");
     auto & p = this->m_set;
     this->check_size(120);
 
@@ -430,7 +548,7 @@ TYPED_TEST(PointSetTest, NearestForwardIterator)
 
 TYPED_TEST(PointSetTest, NearestPointSetCopy)
 {
-    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+    this->load_data("test/etc/test2.dat");
     auto & p = this->m_set;
     this->check_size(120);
 
@@ -449,7 +567,7 @@ TYPED_TEST(PointSetTest, NearestPointSetCopy)
 
 TYPED_TEST(PointSetTest, MultiThreadIteratorAccess)
 {
-    this->load_data("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+    this->load_data("test/etc/test2.dat");
     auto & p = this->m_set;
     this->check_size(120);
 
@@ -471,7 +589,7 @@ TYPED_TEST(PointSetTest, MultiThreadIteratorAccess)
 TYPED_TEST(PointSetTest, MultiThreadIteratorAccessLoadFromFile)
 {
     using point_set_t = typename TestFixture::point_set_t;
-    point_set_t p("C:\\Users\\DNS\\CplusplusProjects\\2d-tree-sandrew-uj\\test\\etc\\test2.dat");
+    point_set_t p("test/etc/test2.dat");
 
     using iterator_t = typename TestFixture::iterator_t;
 
@@ -488,5 +606,993 @@ TYPED_TEST(PointSetTest, MultiThreadIteratorAccessLoadFromFile)
     iterator_test::run_multithread<iterator_t>(jobs);
 }
 
-using TypesToTest = ::testing::Types<PointSetTest<rbtree::PointSet>, PointSetTest<kdtree::PointSet>>;
+TEST(PointSetTest, KDTreeBulkLoad)
+{
+    std::vector<Point> points {Point(0.5, 0.5), Point(0.5, 0.1), Point(0.5, 0.9), Point(0.2, 0.5),
+                               Point(0.8, 0.5), Point(0.5, 0.5), Point(0.1, 0.1), Point(0.2, 0.5)};
+    kdtree::PointSet from_vector(points);
+    kdtree::PointSet from_range(points.begin(), points.end());
+
+    ASSERT_EQ(from_vector.size(), 6);
+    ASSERT_EQ(from_range.size(), 6);
+    ASSERT_EQ(std::distance(from_vector.begin(), from_vector.end()), 6);
+    for (const auto & point : points) {
+        ASSERT_TRUE(from_vector.contains(point));
+        ASSERT_TRUE(from_range.contains(point));
+    }
+    ASSERT_FALSE(from_vector.contains(Point(0.5, 0.2)));
+
+    from_vector.put(Point(0.5, 0.2));
+    from_vector.put(Point(0.5, 0.5));
+    ASSERT_EQ(from_vector.size(), 7);
+    ASSERT_TRUE(from_vector.contains(Point(0.5, 0.2)));
+    ASSERT_EQ(std::distance(from_vector.begin(), from_vector.end()), 7);
+
+    kdtree::PointSet empty(std::vector<Point> {});
+    ASSERT_TRUE(empty.empty());
+    ASSERT_EQ(empty.begin(), empty.end());
+}
+
+// range() walks the tree lazily, neither the query nor its results allocate
+TEST(PointSetTest, KDTreeRangeLazy)
+{
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<> dist(0., 1.);
+    std::vector<Point> points;
+    for (int i = 0; i < 10000; ++i) {
+        points.emplace_back(dist(gen), dist(gen));
+    }
+    const kdtree::PointSet set(points);
+    const rbtree::PointSet expected(points);
+
+    for (const Rect & rect : {Rect(Point(.2, .3), Point(.4, .9)), Rect(Point(0., 0.), Point(1., 1.)), Rect(Point(.5, .5), Point(.5, .5))}) {
+        const std::size_t before = allocations;
+        auto [first, last] = set.range(rect);
+        std::size_t count = 0;
+        for (auto it = first; it != last; ++it) {
+            count += rect.contains(*it) ? 1 : 0;
+        }
+        ASSERT_EQ(allocations, before);
+
+        auto [expected_first, expected_last] = expected.range(rect);
+        ASSERT_EQ(count, static_cast<std::size_t>(std::distance(expected_first, expected_last)));
+        if (first != last) {
+            iterator_test::forward(first, last);
+            iterator_test::test_multipass(first, last);
+        }
+    }
+}
+
+TEST(PointSetTest, KDTreeNearestKEquidistant)
+{
+    kdtree::PointSet p;
+    p.put(Point(1., 0.));
+    p.put(Point(0., 1.));
+    p.put(Point(-1., 0.));
+    p.put(Point(0., -1.));
+    p.put(Point(0.5, 0.));
+    p.put(Point(3., 3.));
+
+    auto [begin, end] = p.nearest(Point(0., 0.), 5);
+    std::vector<Point> result(begin, end);
+    ASSERT_EQ(result.size(), 5);
+    ASSERT_EQ(result.front(), Point(0.5, 0.));
+    for (std::size_t i = 1; i < result.size(); ++i) {
+        ASSERT_DOUBLE_EQ(result[i].distance(Point(0., 0.)), 1.);
+    }
+    ASSERT_EQ(std::set<Point>(result.begin(), result.end()).size(), 5);
+}
+
+TEST(PointSetTest, KDTreeMetrics)
+{
+    std::vector<Point> points {Point(1.1, 0.), Point(0.7, 0.7), Point(-2., 2.)};
+    const Point origin(0., 0.);
+
+    kdtree::PointSet l2(points);
+    ASSERT_EQ(*l2.nearest(origin), Point(0.7, 0.7));
+
+    kdtree::BasicPointSet<kdtree::metric::L1> l1(points);
+    ASSERT_EQ(*l1.nearest(origin), Point(1.1, 0.));
+
+    kdtree::BasicPointSet<kdtree::metric::Chebyshev> chebyshev(points);
+    ASSERT_EQ(*chebyshev.nearest(origin), Point(0.7, 0.7));
+
+    kdtree::BasicPointSet<kdtree::metric::WeightedL2> weighted(points, kdtree::metric::WeightedL2(1., 4.));
+    ASSERT_EQ(*weighted.nearest(origin), Point(1.1, 0.));
+    auto [begin, end] = weighted.nearest(origin, 3);
+    ASSERT_EQ(std::vector<Point>(begin, end), (std::vector<Point> {Point(1.1, 0.), Point(0.7, 0.7), Point(-2., 2.)}));
+}
+
+TEST(PointSetTest, StaticPointSet)
+{
+    kdtree::PointSet dynamic("test/etc/test2.dat");
+    kdtree::StaticPointSet p(dynamic);
+    ASSERT_EQ(p.size(), 120);
+    ASSERT_EQ(std::distance(p.begin(), p.end()), 120);
+    for (const auto & point : dynamic) {
+        ASSERT_TRUE(p.contains(point));
+    }
+    ASSERT_FALSE(p.contains(Point(0.5, 0.5)));
+
+    auto range = p.range(Rect(Point(0.3, 0.3), Point(.7, .7)));
+    auto dynamic_range = dynamic.range(Rect(Point(0.3, 0.3), Point(.7, .7)));
+    ASSERT_EQ(std::set<Point>(range.first, range.second), std::set<Point>(dynamic_range.first, dynamic_range.second));
+
+    ASSERT_EQ(*p.nearest(Point(.712, .567)), Point(0.718, 0.555));
+    auto nearest = p.nearest(Point(.386, .759), 3);
+    ASSERT_EQ(std::vector<Point>(nearest.first, nearest.second), (std::vector<Point> {Point(0.376, 0.767), Point(0.409, 0.754), Point(0.408, 0.728)}));
+
+    for (std::size_t bucket_size : {1, 5, 64}) {
+        kdtree::StaticPointSet bucketed(dynamic, bucket_size);
+        ASSERT_EQ(bucketed.bucket_size(), bucket_size);
+        for (const auto & point : dynamic) {
+            ASSERT_TRUE(bucketed.contains(point));
+        }
+        auto bucketed_range = bucketed.range(Rect(Point(0.3, 0.3), Point(.7, .7)));
+        ASSERT_EQ(std::set<Point>(bucketed_range.first, bucketed_range.second), std::set<Point>(range.first, range.second));
+        auto bucketed_nearest = bucketed.nearest(Point(.386, .759), 3);
+        ASSERT_TRUE(std::equal(bucketed_nearest.first, bucketed_nearest.second, nearest.first, nearest.second));
+    }
+
+    kdtree::StaticPointSet empty;
+    ASSERT_TRUE(empty.empty());
+    ASSERT_FALSE(empty.nearest(Point(0., 0.)).has_value());
+    auto empty_range = empty.range(Rect(Point(0., 0.), Point(1., 1.)));
+    ASSERT_EQ(empty_range.first, empty_range.second);
+}
+
+TEST(PointSetTest, LogPointSetMerges)
+{
+    kdtree::PointSet dynamic("test/etc/test2.dat");
+    kdtree::LogPointSet p;
+    std::size_t count = 0;
+    for (const auto & point : dynamic) {
+        p.put(point);
+        p.put(point);
+        ASSERT_EQ(p.size(), ++count);
+        ASSERT_EQ(std::distance(p.begin(), p.end()), count);
+    }
+    for (const auto & point : dynamic) {
+        ASSERT_TRUE(p.contains(point));
+    }
+
+    kdtree::LogPointSet bulk(std::vector<Point>(dynamic.begin(), dynamic.end()));
+    ASSERT_EQ(std::set<Point>(bulk.begin(), bulk.end()), std::set<Point>(p.begin(), p.end()));
+
+    auto range = p.range(Rect(Point(0.3, 0.3), Point(.7, .7)));
+    auto dynamic_range = dynamic.range(Rect(Point(0.3, 0.3), Point(.7, .7)));
+    ASSERT_EQ(std::set<Point>(range.first, range.second), std::set<Point>(dynamic_range.first, dynamic_range.second));
+
+    auto nearest = p.nearest(Point(.386, .759), 3);
+    ASSERT_EQ(std::vector<Point>(nearest.first, nearest.second), (std::vector<Point> {Point(0.376, 0.767), Point(0.409, 0.754), Point(0.408, 0.728)}));
+}
+
+TEST(PointSetTest, ConcurrentPointSetSnapshots)
+{
+    kdtree::PointSet source("test/etc/test2.dat");
+    kdtree::ConcurrentPointSet p(std::vector<Point> {});
+
+    std::atomic<bool> done {false};
+    std::vector<std::thread> readers;
+    std::atomic<std::size_t> failures {0};
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&p, &done, &failures]() {
+            std::size_t last = 0;
+            while (!done) {
+                auto snapshot = p.snapshot();
+                const auto size = static_cast<std::size_t>(std::distance(snapshot->begin(), snapshot->end()));
+                if (size != snapshot->size() || size < last) {
+                    ++failures;
+                }
+                last = size;
+            }
+        });
+    }
+
+    auto held = p.snapshot();
+    for (const auto & point : source) {
+        p.put(point);
+        p.publish();
+    }
+    done = true;
+    for (auto & reader : readers) {
+        reader.join();
+    }
+
+    ASSERT_EQ(failures, 0);
+    ASSERT_TRUE(held->empty());
+    ASSERT_EQ(p.size(), 120);
+    for (const auto & point : source) {
+        ASSERT_TRUE(p.contains(point));
+    }
+}
+
+TEST(PointSetTest, ConcurrentPointSetReclaim)
+{
+    kdtree::ConcurrentPointSet p(std::vector<Point> {Point(0., 0.)});
+    {
+        auto held = p.snapshot();
+        p.put(Point(1., 1.));
+        p.publish();
+        ASSERT_EQ(p.retired(), 1);
+
+        // nothing new to publish, the current version stays
+        const auto * current = &*p.snapshot();
+        p.put(Point(1., 1.));
+        p.publish();
+        ASSERT_EQ(&*p.snapshot(), current);
+        ASSERT_EQ(p.retired(), 1);
+        ASSERT_EQ(held->size(), 1);
+    }
+    // the last reader of the replaced version freed it
+    ASSERT_EQ(p.retired(), 0);
+    ASSERT_EQ(p.size(), 2);
+}
+
+TEST(PointSetTest, ConcurrentPointSetPinned)
+{
+    kdtree::ConcurrentPointSet p(std::vector<Point> {Point(0., 0.)});
+    auto pinned = p.snapshot();
+    p.put(Point(1., 1.));
+    p.publish();
+    {
+        auto newer = p.snapshot();
+        p.put(Point(2., 2.));
+        p.publish();
+        ASSERT_EQ(p.retired(), 2);
+    }
+    // readers newer than the oldest retired version leave without reclaiming,
+    // as the pinned reader holds back everything retired since it started
+    ASSERT_EQ(p.retired(), 2);
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_TRUE(p.contains(Point(2., 2.)));
+    }
+    p.publish();
+    ASSERT_EQ(p.retired(), 2);
+    ASSERT_EQ(pinned->size(), 1);
+
+    // the oldest reader frees all of it when it leaves
+    {
+        auto leaving = std::move(pinned);
+    }
+    ASSERT_EQ(p.retired(), 0);
+}
+
+TEST(PointSetTest, ConcurrentPointSetOverflow)
+{
+    kdtree::ConcurrentPointSet p(std::vector<Point> {Point(0., 0.)});
+    {
+        // more readers than slots don't wait, and keep every retired version
+        std::vector<kdtree::ConcurrentPointSet::Snapshot> held;
+        for (std::size_t i = 0; i < 2 * kdtree::ConcurrentPointSet::max_readers; ++i) {
+            held.push_back(p.snapshot());
+        }
+        p.put(Point(1., 1.));
+        p.publish();
+        ASSERT_EQ(p.retired(), 1);
+        // the last ones are counted, one of them is still held
+        for (std::size_t i = 1; i < kdtree::ConcurrentPointSet::max_readers; ++i) {
+            held.pop_back();
+        }
+        p.publish();
+        ASSERT_EQ(p.retired(), 1);
+        for (const auto & snapshot : held) {
+            ASSERT_EQ(snapshot->size(), 1);
+        }
+    }
+    ASSERT_EQ(p.retired(), 0);
+    ASSERT_EQ(p.size(), 2);
+}
+
+TEST(PointSetTest, ConcurrentPointSetSharing)
+{
+    std::vector<Point> points;
+    for (int i = 0; i < 1024; ++i) {
+        points.emplace_back(i / 1024., (i * 37 % 1024) / 1024.);
+    }
+    kdtree::ConcurrentPointSet p(points);
+    auto held = p.snapshot();
+    const std::vector<Point> expected(held->begin(), held->end());
+
+    // the new version keeps the level of the first 1024 points instead of copying it
+    p.put(Point(2., 2.));
+    const std::size_t before = allocated_bytes;
+    p.publish();
+    ASSERT_LT(allocated_bytes - before, 1024 * sizeof(double));
+    {
+        auto current = p.snapshot();
+        ASSERT_EQ(current->size(), 1025);
+    }
+
+    // publishing every point doesn't copy the whole set each time
+    for (int i = 0; i < 50000; ++i) {
+        p.put(Point(3. + i, 3.));
+        p.publish();
+    }
+    ASSERT_EQ(p.size(), 51025);
+    ASSERT_EQ(std::vector<Point>(held->begin(), held->end()), expected);
+}
+
+TEST(PointSetTest, KDTreeParallelBuild)
+{
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<double> coordinate(0., 1.);
+    std::vector<Point> points;
+    for (int i = 0; i < 100000; ++i) {
+        points.emplace_back(coordinate(gen), coordinate(gen));
+    }
+
+    // the snapshots hold the node pools as they are, so they show the same tree
+    const std::string filename = "test/etc/parallel.bin";
+    auto snapshot = [&filename](const kdtree::PointSet & set) {
+        set.save(filename);
+        std::ostringstream bytes;
+        bytes << std::ifstream(filename, std::ios::binary).rdbuf();
+        return bytes.str();
+    };
+    kdtree::PointSet sequential(points);
+    const std::string expected_snapshot = snapshot(sequential);
+    for (std::size_t threads : {2, 4, 0}) {
+        kdtree::PointSet parallel(points, {}, threads);
+        ASSERT_EQ(parallel.size(), sequential.size());
+        ASSERT_EQ(snapshot(parallel), expected_snapshot);
+        ASSERT_TRUE(std::equal(parallel.begin(), parallel.end(), sequential.begin(), sequential.end()));
+        auto nearest = parallel.nearest(Point(.5, .5), 10);
+        auto expected = sequential.nearest(Point(.5, .5), 10);
+        ASSERT_TRUE(std::equal(nearest.first, nearest.second, expected.first, expected.second));
+    }
+}
+
+TEST(PointSetTest, KDTreeNearestBatch)
+{
+    kdtree::PointSet p("test/etc/test2.dat");
+    std::vector<Point> queries;
+    for (int i = 0; i <= 500; ++i) {
+        queries.emplace_back(i / 500., (i * 37 % 500) / 500.);
+    }
+    for (std::size_t threads : {1, 4}) {
+        auto batch = p.nearest_batch(queries, 5, threads);
+        ASSERT_EQ(batch.stride, 5);
+        ASSERT_EQ(batch.points.size(), queries.size() * 5);
+        for (std::size_t i = 0; i < queries.size(); ++i) {
+            auto [first, last] = p.nearest(queries[i], 5);
+            ASSERT_TRUE(std::equal(first, last, batch.points.begin() + i * 5, batch.points.begin() + (i + 1) * 5));
+            for (std::size_t j = 0; j < 5; ++j) {
+                ASSERT_DOUBLE_EQ(batch.distances[i * 5 + j], queries[i].distance(batch.points[i * 5 + j]));
+            }
+        }
+    }
+    ASSERT_EQ(p.nearest_batch(queries, 1000).stride, 120);
+    ASSERT_TRUE(kdtree::PointSet().nearest_batch(queries, 3).points.empty());
+
+    kdtree::ThreadPool pool(4);
+    const auto expected = p.nearest_batch(queries, 5, 1);
+    for (int round = 0; round < 2; ++round) {
+        ASSERT_EQ(p.nearest_batch(queries, 5, pool).points, expected.points);
+    }
+    // threads outside the pool push their tasks onto one shared queue
+    std::atomic<std::size_t> mismatches {0};
+    std::vector<std::thread> callers;
+    for (int i = 0; i < 3; ++i) {
+        callers.emplace_back([&]() {
+            for (int round = 0; round < 5; ++round) {
+                mismatches += p.nearest_batch(queries, 5, pool).points != expected.points ? 1 : 0;
+            }
+        });
+    }
+    for (auto & caller : callers) {
+        caller.join();
+    }
+    ASSERT_EQ(mismatches, 0);
+    // a warm pool allocates nothing but the result
+    kdtree::ThreadPool caller_only(1);
+    const std::vector<Point> few(queries.begin(), queries.begin() + 64);
+    p.nearest_batch(few, 5, caller_only);
+    const std::size_t before = allocations;
+    p.nearest_batch(few, 5, caller_only);
+    ASSERT_EQ(allocations - before, 2);
+}
+
+TEST(PointSetTest, KDTreeRangeBatch)
+{
+    kdtree::PointSet p("test/etc/test2.dat");
+    std::vector<Rect> rects;
+    for (int i = 0; i < 300; ++i) {
+        const double x = (i * 53 % 300) / 300., y = (i * 17 % 300) / 300., size = (i % 7) / 10.;
+        rects.emplace_back(Point(x, y), Point(x + size, y + size));
+    }
+    for (std::size_t threads : {1, 4}) {
+        auto batch = p.range_batch(rects, threads);
+        ASSERT_EQ(batch.offsets.size(), rects.size() + 1);
+        ASSERT_EQ(batch.offsets.back(), batch.points.size());
+        for (std::size_t i = 0; i < rects.size(); ++i) {
+            auto [first, last] = p.range(rects[i]);
+            ASSERT_EQ(std::set<Point>(batch.points.begin() + batch.offsets[i], batch.points.begin() + batch.offsets[i + 1]), std::set<Point>(first, last));
+        }
+    }
+    auto empty = p.range_batch({});
+    ASSERT_EQ(empty.offsets, std::vector<std::size_t> {0});
+
+    kdtree::ThreadPool pool(4);
+    const auto expected = p.range_batch(rects, 1);
+    for (int round = 0; round < 2; ++round) {
+        auto batch = p.range_batch(rects, pool);
+        ASSERT_EQ(batch.offsets, expected.offsets);
+        ASSERT_EQ(batch.points, expected.points);
+    }
+}
+
+TEST(PointSetTest, KDTreeCount)
+{
+    kdtree::PointSet p;
+    ASSERT_EQ(p.count(Rect(Point(0., 0.), Point(1., 1.))), 0);
+    kdtree::PointSet loaded("test/etc/test2.dat");
+    for (const auto & point : loaded) {
+        p.put(point);
+    }
+    for (const auto * set : {&p, &loaded}) {
+        for (int i = 0; i < 200; ++i) {
+            const double x = (i * 53 % 200) / 200., y = (i * 17 % 200) / 200., size = (i % 11) / 10.;
+            Rect rect(Point(x - size / 2, y - size / 2), Point(x + size, y + size));
+            auto [first, last] = set->range(rect);
+            ASSERT_EQ(set->count(rect), std::distance(first, last));
+        }
+        ASSERT_EQ(set->count(Rect(Point(-1., -1.), Point(2., 2.))), 120);
+    }
+}
+
+TEST(PointSetTest, Within)
+{
+    rbtree::PointSet rb("test/etc/test2.dat");
+    kdtree::PointSet kd("test/etc/test2.dat");
+    for (const auto & [center, radius] : std::vector<std::pair<Point, double>> {{Point(0., 0.), .5}, {Point(.5, .5), .213}, {Point(.3, .8), .0731}, {Point(2., 2.), .1}, {Point(.5, .5), -1.}}) {
+        std::set<Point> expected;
+        for (const auto & point : kd) {
+            if (center.distance(point) <= radius) {
+                expected.insert(point);
+            }
+        }
+        auto [rb_first, rb_last] = rb.within(center, radius);
+        auto [kd_first, kd_last] = kd.within(center, radius);
+        ASSERT_EQ(std::set<Point>(rb_first, rb_last), expected);
+        ASSERT_EQ(std::set<Point>(kd_first, kd_last), expected);
+        ASSERT_EQ(std::distance(kd_first, kd_last), expected.size());
+    }
+    auto nearest = rb.nearest(Point(0., 0.), 3);
+    ASSERT_EQ(std::distance(nearest.first, nearest.second), 3);
+}
+
+// points on the x axis around the circle, where the rounding of the window of
+// x coordinates is larger than the rounding of the distances
+TEST(PointSetTest, WithinBoundary)
+{
+    std::mt19937 gen(5);
+    std::uniform_real_distribution<> coordinate(-10., 10.), length(0., 5.);
+    const double inf = std::numeric_limits<double>::infinity();
+    for (int round = 0; round < 200; ++round) {
+        const Point center(coordinate(gen), 0.);
+        const double radius = length(gen);
+        std::vector<Point> points;
+        for (double x : {center.x() - radius, center.x() + radius}) {
+            for (int i = 0; i < 16; ++i) {
+                x = std::nextafter(x, -inf);
+            }
+            for (int i = 0; i < 32; ++i, x = std::nextafter(x, inf)) {
+                points.emplace_back(x, 0.);
+            }
+        }
+        const rbtree::PointSet p(points);
+        const kdtree::PointSet k(points);
+        // both sets compare squared distances
+        const auto expected = std::count_if(p.begin(), p.end(), [&](const Point & point) {
+            const double dx = point.x() - center.x(), dy = point.y() - center.y();
+            return dx * dx + dy * dy <= radius * radius;
+        });
+        auto [first, last] = p.within(center, radius);
+        ASSERT_EQ(std::distance(first, last), expected) << center << " " << radius;
+        // kdtree drops the points closer than Point::operator== tells apart, the rest have to match
+        const std::set<Point> found(first, last);
+        auto [k_first, k_last] = k.within(center, radius);
+        const std::set<Point> k_found(k_first, k_last);
+        for (const auto & point : k) {
+            ASSERT_EQ(k_found.count(point), found.count(point)) << point << " " << center << " " << radius;
+        }
+    }
+
+    // grid points whose distance rounds to the radius while its square is above the squared radius
+    const std::vector<Point> grid {Point(0.42105263157894735, 0.78947368421052633), Point(0.78947368421052633, 0.42105263157894735)};
+    const Point center(0.63157894736842102, 0.63157894736842102);
+    const double radius = 0.26315789473684209;
+    const rbtree::PointSet p(grid);
+    const kdtree::PointSet k(grid);
+    auto [first, last] = p.within(center, radius);
+    auto [k_first, k_last] = k.within(center, radius);
+    ASSERT_EQ(std::distance(first, last), std::distance(k_first, k_last));
+    ASSERT_EQ(std::set<Point>(k_first, k_last), std::set<Point>(first, last));
+}
+
+TEST(PointSetTest, KDTreeErase)
+{
+    kdtree::PointSet p("test/etc/test2.dat");
+    std::vector<Point> points(p.begin(), p.end());
+    ASSERT_FALSE(p.erase(Point(2., 2.)));
+    for (std::size_t i = 0; i < points.size(); i += 2) {
+        ASSERT_TRUE(p.erase(points[i]));
+        ASSERT_FALSE(p.erase(points[i]));
+    }
+    ASSERT_EQ(p.size(), 60);
+    ASSERT_EQ(std::distance(p.begin(), p.end()), 60);
+
+    std::set<Point> left;
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        ASSERT_EQ(p.contains(points[i]), i % 2 == 1);
+        if (i % 2 == 1) {
+            left.insert(points[i]);
+        }
+    }
+    ASSERT_EQ(std::set<Point>(p.begin(), p.end()), left);
+    const Rect rect(Point(.2, .2), Point(.7, .7));
+    auto [first, last] = p.range(rect);
+    std::set<Point> inside;
+    std::copy_if(left.begin(), left.end(), std::inserter(inside, inside.end()), [&rect](const Point & point) { return rect.contains(point); });
+    ASSERT_EQ(std::set<Point>(first, last), inside);
+    ASSERT_EQ(p.count(rect), std::distance(first, last));
+    ASSERT_TRUE(left.count(*p.nearest(Point(.5, .5))));
+
+    p.put(points[0]);
+    ASSERT_TRUE(p.contains(points[0]));
+    ASSERT_EQ(p.size(), 61);
+    for (const auto & point : points) {
+        p.erase(point);
+    }
+    ASSERT_TRUE(p.empty());
+    ASSERT_EQ(p.begin(), p.end());
+    ASSERT_FALSE(p.nearest(Point(.5, .5)).has_value());
+}
+
+TEST(PointSetTest, LoadPoints)
+{
+    ASSERT_EQ(load_points("test/etc/test2.dat").size(), 120);
+    ASSERT_EQ(load_points("test/etc/no_newline.dat"), (std::vector<Point> {Point(.1, .2), Point(.3, .4)}));
+    ASSERT_TRUE(load_points("").empty());
+    ASSERT_THROW(load_points("test/etc/missing.dat"), std::runtime_error);
+    try {
+        load_points("test/etc/malformed.dat");
+        FAIL();
+    }
+    catch (const std::runtime_error & e) {
+        ASSERT_EQ(std::string(e.what()), "test/etc/malformed.dat:4: expected two numbers");
+    }
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+TEST(PointSetTest, LoadPointsFifo)
+{
+    const std::string filename = "test/etc/points.fifo";
+    std::remove(filename.c_str());
+    ASSERT_EQ(::mkfifo(filename.c_str(), 0600), 0);
+    std::vector<Point> expected;
+    for (int i = 0; i < 20000; ++i) {
+        expected.emplace_back(i / 20000., 1 - i / 20000.);
+    }
+    std::thread writer([&]() {
+        std::ofstream out(filename);
+        out.precision(17);
+        for (const auto & point : expected) {
+            out << point.x() << " " << point.y() << "\n";
+        }
+    });
+    const auto loaded = load_points(filename);
+    writer.join();
+    ASSERT_EQ(loaded, expected);
+
+    // the contents of a pipe are on the heap, which mustn't be unmapped with the file
+    for (int round = 0; round < 8; ++round) {
+        std::thread small_writer([&]() { std::ofstream(filename) << std::string(std::size_t(4096) << round, 'x'); });
+        {
+#if defined(__linux__)
+            const std::size_t before = unmappings;
+#endif
+            {
+                const MappedFile file(filename);
+                small_writer.join();
+                ASSERT_EQ(file.size(), std::size_t(4096) << round);
+            }
+#if defined(__linux__)
+            ASSERT_EQ(unmappings, before);
+#endif
+        }
+        std::vector<char> reused(std::size_t(4096) << round, 'y');
+        ASSERT_EQ(std::count(reused.begin(), reused.end(), 'y'), static_cast<std::ptrdiff_t>(reused.size()));
+    }
+#if defined(__linux__)
+    // while a regular file is unmapped once
+    const std::size_t before = unmappings;
+    { const MappedFile file("test/etc/test2.dat"); }
+    ASSERT_EQ(unmappings, before + 1);
+#endif
+    std::remove(filename.c_str());
+}
+#endif
+
+TEST(PointSetTest, LoadPointsNotFinite)
+{
+    const std::string filename = "test/etc/not_finite.dat";
+    for (const std::string line : {"nan 0.5", "0.5 inf", "-infinity 0.5", "0.5 1e400"}) {
+        {
+            std::ofstream out(filename);
+            out << "0.1 0.2\n" << line << "\n0.3 0.4\n";
+        }
+        try {
+            load_points(filename);
+            FAIL() << line;
+        }
+        catch (const std::runtime_error & e) {
+            ASSERT_EQ(std::string(e.what()), filename + ":2: expected two numbers");
+        }
+    }
+    std::remove(filename.c_str());
+}
+
+TEST(PointSetTest, LoadPointsParallel)
+{
+    const std::string filename = "test/etc/generated.dat";
+    {
+        std::ofstream out(filename);
+        std::mt19937 gen(11);
+        std::uniform_real_distribution<double> coordinate(0., 1.);
+        for (int i = 0; i < 300000; ++i) {
+            out << coordinate(gen) << " " << coordinate(gen) << "\n";
+        }
+    }
+    const auto sequential = load_points(filename);
+    ASSERT_EQ(sequential.size(), 300000);
+    ASSERT_EQ(load_points(filename, 4), sequential);
+    ASSERT_EQ(load_points(filename, 0), sequential);
+    kdtree::ThreadPool pool(4);
+    ASSERT_EQ(load_points(filename, pool), sequential);
+
+    kdtree::PointSet p(filename, {}, 4);
+    ASSERT_EQ(p.size(), std::set<Point>(sequential.begin(), sequential.end()).size());
+
+    {
+        std::ofstream out(filename, std::ios::app);
+        out << "0.5\n";
+    }
+    try {
+        load_points(filename, 4);
+        FAIL();
+    }
+    catch (const std::runtime_error & e) {
+        ASSERT_EQ(std::string(e.what()), filename + ":300001: expected two numbers");
+    }
+    std::remove(filename.c_str());
+}
+
+TEST(PointSetTest, KDTreeSaveLoad)
+{
+    const std::string filename = "test/etc/snapshot.bin";
+    kdtree::PointSet p("test/etc/test2.dat");
+    std::vector<Point> points(p.begin(), p.end());
+    for (std::size_t i = 0; i < points.size(); i += 3) {
+        p.erase(points[i]);
+    }
+    p.put(Point(2., 2.));
+    p.save(filename);
+
+    auto loaded = kdtree::PointSet::load(filename);
+    ASSERT_EQ(loaded.size(), p.size());
+    ASSERT_TRUE(std::equal(loaded.begin(), loaded.end(), p.begin(), p.end()));
+    auto nearest = loaded.nearest(Point(.386, .759), 3);
+    auto expected = p.nearest(Point(.386, .759), 3);
+    ASSERT_TRUE(std::equal(nearest.first, nearest.second, expected.first, expected.second));
+    loaded.put(Point(3., 3.));
+    ASSERT_TRUE(loaded.erase(points[1]));
+    ASSERT_EQ(loaded.size(), p.size());
+
+    kdtree::PointSet().save(filename);
+    ASSERT_TRUE(kdtree::PointSet::load(filename).empty());
+
+    p.save(filename);
+    {
+        std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(100);
+        file.put('\x7f');
+    }
+    ASSERT_THROW(kdtree::PointSet::load(filename), std::runtime_error);
+    ASSERT_THROW(kdtree::PointSet::load("test/etc/test2.dat"), std::runtime_error);
+    ASSERT_THROW(kdtree::PointSet::load("test/etc/missing.bin"), std::runtime_error);
+
+    // a broken tree behind a valid checksum: the bulk loaded root is the first
+    // node, and the checksum is FNV-1a over everything before it
+    using Node = kdtree::PointSet::Node;
+    const kdtree::PointSet balanced(points);
+    auto read_file = [&filename]() {
+        std::ostringstream bytes;
+        bytes << std::ifstream(filename, std::ios::binary).rdbuf();
+        return bytes.str();
+    };
+    constexpr std::size_t header_size = 48;
+    auto rewrite_at = [&](std::size_t offset, auto value) {
+        balanced.save(filename);
+        std::string bytes = read_file();
+        std::memcpy(&bytes[offset], &value, sizeof(value));
+        std::uint64_t sum = 0xcbf29ce484222325;
+        for (std::size_t i = 0; i + sizeof(sum) < bytes.size(); ++i) {
+            sum = (sum ^ static_cast<unsigned char>(bytes[i])) * 0x100000001b3;
+        }
+        std::memcpy(&bytes[bytes.size() - sizeof(sum)], &sum, sizeof(sum));
+        std::ofstream(filename, std::ios::binary) << bytes;
+    };
+    auto rewrite = [&](std::size_t node_offset, std::uint32_t value) { rewrite_at(header_size + node_offset, value); };
+    auto load_error = [&filename]() -> std::string {
+        try {
+            kdtree::PointSet::load(filename);
+        }
+        catch (const std::runtime_error & e) {
+            return e.what();
+        }
+        return {};
+    };
+    rewrite(offsetof(Node, m_total), static_cast<std::uint32_t>(balanced.size()));
+    ASSERT_EQ(load_error(), "");
+    {
+        // the padding of the nodes is written as zeros, so the same tree always
+        // saves to the same bytes
+        const std::string bytes = read_file();
+        ASSERT_EQ(bytes.size(), header_size + balanced.size() * sizeof(Node) + sizeof(std::uint64_t));
+        // nor is there anything unset in the header, whose reserved word follows five others
+        ASSERT_EQ(bytes.substr(20, 4), std::string(4, '\0'));
+        const std::size_t used = offsetof(Node, m_dead) + sizeof(bool);
+        for (std::size_t i = 0; i < balanced.size(); ++i) {
+            const std::size_t node = header_size + i * sizeof(Node);
+            for (std::size_t j = used; j < sizeof(Node); ++j) {
+                ASSERT_EQ(bytes[node + j], '\0') << "node " << i << " byte " << j;
+            }
+        }
+    }
+    rewrite(offsetof(Node, m_left), static_cast<std::uint32_t>(balanced.size()));
+    ASSERT_NE(load_error().find("inconsistent snapshot"), std::string::npos);
+    rewrite(offsetof(Node, m_right), 0);
+    ASSERT_NE(load_error().find("inconsistent snapshot"), std::string::npos);
+    rewrite(offsetof(Node, m_next), 1);
+    ASSERT_NE(load_error().find("inconsistent snapshot"), std::string::npos);
+    rewrite(offsetof(Node, m_total), 7);
+    ASSERT_NE(load_error().find("inconsistent snapshot"), std::string::npos);
+    // the root given the point of its left child, the first node after it, still
+    // inside its box; and a box of the root holding its point only
+    Point root, left;
+    {
+        balanced.save(filename);
+        const std::string bytes = read_file();
+        std::memcpy(&root, &bytes[header_size + offsetof(Node, m_point)], sizeof(Point));
+        std::memcpy(&left, &bytes[header_size + sizeof(Node) + offsetof(Node, m_point)], sizeof(Point));
+    }
+    rewrite_at(header_size + offsetof(Node, m_point), left);
+    ASSERT_NE(load_error().find("inconsistent snapshot"), std::string::npos);
+    rewrite_at(header_size + offsetof(Node, m_box), Rect(root, root));
+    ASSERT_NE(load_error().find("inconsistent snapshot"), std::string::npos);
+    // flags which are not a valid bool
+    rewrite_at(header_size + offsetof(Node, is_x), std::uint8_t(2));
+    ASSERT_NE(load_error().find("inconsistent snapshot"), std::string::npos);
+    rewrite_at(header_size + sizeof(Node) + offsetof(Node, m_dead), std::uint8_t(0xff));
+    ASSERT_NE(load_error().find("inconsistent snapshot"), std::string::npos);
+    // a node count far beyond the file, the count follows the reserved word and the size
+    rewrite_at(32, std::uint64_t(0xfffffff0));
+    ASSERT_NE(load_error().find("file size doesn't match the header"), std::string::npos);
+    const std::uint64_t one_more = balanced.size() + 1;
+    rewrite_at(32, one_more);
+    ASSERT_NE(load_error().find("file size doesn't match the header"), std::string::npos);
+    std::remove(filename.c_str());
+}
+
+TEST(PointSetTest, StaticPointSetIndexFile)
+{
+    const std::string filename = "test/etc/index.bin";
+    kdtree::PointSet dynamic("test/etc/test2.dat");
+    kdtree::StaticPointSet p(dynamic, 5);
+    p.save(filename);
+
+    auto mapped = kdtree::StaticPointSet::open(filename);
+    ASSERT_EQ(mapped.size(), p.size());
+    ASSERT_EQ(mapped.bucket_size(), 5);
+    ASSERT_TRUE(std::equal(mapped.begin(), mapped.end(), p.begin(), p.end()));
+    for (const auto & point : dynamic) {
+        ASSERT_TRUE(mapped.contains(point));
+    }
+    ASSERT_FALSE(mapped.contains(Point(0.5, 0.5)));
+    auto range = mapped.range(Rect(Point(0.3, 0.3), Point(.7, .7)));
+    auto expected_range = p.range(Rect(Point(0.3, 0.3), Point(.7, .7)));
+    ASSERT_EQ(std::set<Point>(range.first, range.second), std::set<Point>(expected_range.first, expected_range.second));
+    auto nearest = mapped.nearest(Point(.386, .759), 3);
+    auto expected = p.nearest(Point(.386, .759), 3);
+    ASSERT_TRUE(std::equal(nearest.first, nearest.second, expected.first, expected.second));
+
+    // copies share the mapping, which outlives the set it was opened for
+    auto copy = mapped;
+    mapped = kdtree::StaticPointSet();
+    ASSERT_EQ(*copy.nearest(Point(.712, .567)), Point(0.718, 0.555));
+
+    kdtree::StaticPointSet().save(filename);
+    ASSERT_TRUE(kdtree::StaticPointSet::open(filename).empty());
+
+    p.save(filename);
+    {
+        std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(16);
+        file.put('\x7f');
+    }
+    ASSERT_THROW(kdtree::StaticPointSet::open(filename), std::runtime_error);
+    ASSERT_THROW(kdtree::StaticPointSet::open("test/etc/test2.dat"), std::runtime_error);
+    ASSERT_THROW(kdtree::StaticPointSet::open("test/etc/missing.bin"), std::runtime_error);
+    std::remove(filename.c_str());
+}
+
+TEST(PointSetTest, KDTreeInstrumentation)
+{
+    using kdtree::instrumentation::Counter;
+    ASSERT_EQ(kdtree::PointSet::stats()[Counter::NodesVisited], 0);
+
+    const auto before = kdtree::CountingPointSet::stats();
+    kdtree::CountingPointSet p;
+    for (int i = 0; i < 1000; ++i) {
+        p.put(Point(i, i));
+    }
+    auto work = kdtree::CountingPointSet::stats() - before;
+    ASSERT_EQ(work[Counter::Allocations], 1000);
+    ASSERT_GT(work[Counter::Rebalances], 0);
+    ASSERT_GE(work[Counter::RebuiltNodes], 2 * work[Counter::Rebalances]);
+
+    auto start = kdtree::CountingPointSet::stats();
+    ASSERT_TRUE(p.contains(Point(500, 500)));
+    work = kdtree::CountingPointSet::stats() - start;
+    ASSERT_GT(work[Counter::NodesVisited], 0);
+    ASSERT_LE(work[Counter::NodesVisited], kdtree::CountingPointSet::max_depth);
+    ASSERT_EQ(work[Counter::DistanceEvaluations], 0);
+
+    ASSERT_EQ(p.count(Rect(Point(-1., -1.), Point(1000., 1000.))), 1000);
+    auto range = p.range(Rect(Point(-1., -1.), Point(1000., 1000.)));
+    ASSERT_EQ(std::distance(range.first, range.second), 1000);
+    start = kdtree::CountingPointSet::stats();
+    ASSERT_EQ(*p.nearest(Point(10.2, 10.1)), Point(10, 10));
+    work = kdtree::CountingPointSet::stats() - start;
+    ASSERT_GT(work[Counter::DistanceEvaluations], 0);
+    ASSERT_LT(work[Counter::NodesVisited], 100);
+
+    // counters of other threads are kept after they finish
+    start = kdtree::CountingPointSet::stats();
+    const auto here = kdtree::instrumentation::Counting::thread_snapshot();
+    std::thread([&p]() { p.nearest(Point(0., 0.)); }).join();
+    ASSERT_GT((kdtree::CountingPointSet::stats() - start)[Counter::NodesVisited], 0);
+    ASSERT_EQ(kdtree::instrumentation::Counting::thread_snapshot()[Counter::NodesVisited], here[Counter::NodesVisited]);
+    ASSERT_EQ(kdtree::PointSet::stats()[Counter::NodesVisited], 0);
+}
+
+TEST(PointSetTest, LatencyHistogram)
+{
+    // every value falls into a bucket no wider than 1/16 of it
+    for (std::uint64_t value : {0ull, 1ull, 31ull, 32ull, 33ull, 1000ull, 123456789ull, ~0ull}) {
+        const auto index = LatencyHistogram::bucket(value);
+        ASSERT_LT(index, LatencyHistogram::bucket_count);
+        ASSERT_GE(LatencyHistogram::bucket_high(index), value);
+        ASSERT_TRUE(index == 0 || LatencyHistogram::bucket_high(index - 1) < value);
+        ASSERT_LE(LatencyHistogram::bucket_high(index) - value, value / 16);
+    }
+
+    auto histogram = std::make_unique<LatencyHistogram>();
+    ASSERT_EQ(histogram->snapshot().percentile(.5), 0);
+    for (std::uint64_t value = 1; value <= 10000; ++value) {
+        histogram->record(value * 100);
+    }
+    const auto snapshot = histogram->snapshot();
+    ASSERT_EQ(snapshot.total, 10000);
+    ASSERT_EQ(snapshot.max, 1000000);
+    for (double q : {.5, .9, .99, .999}) {
+        const double exact = q * 1000000;
+        ASSERT_GE(snapshot.percentile(q), exact);
+        ASSERT_LE(snapshot.percentile(q), exact * (1. + 1. / 16));
+    }
+    ASSERT_EQ(snapshot.percentile(1.), 1000000);
+
+    auto other = std::make_unique<LatencyHistogram>();
+    other->record(5000000);
+    auto merged = snapshot;
+    merged += other->snapshot();
+    ASSERT_EQ(merged.total, 10001);
+    ASSERT_EQ(merged.max, 5000000);
+    ASSERT_EQ(merged.percentile(1.), 5000000);
+    ASSERT_EQ(merged.percentile(.5), snapshot.percentile(.5));
+}
+
+// points sharing the splitting coordinate are split by the other one, so a
+// column of them doesn't make every put() rebuild the tree
+TEST(PointSetTest, KDTreeEqualCoordinates)
+{
+    using kdtree::instrumentation::Counter;
+    std::mt19937 gen(11);
+    std::uniform_real_distribution<> dist(0., 1.);
+    constexpr std::size_t count = 5000;
+
+    const auto before = kdtree::instrumentation::Counting::thread_snapshot();
+    kdtree::CountingPointSet p;
+    for (std::size_t i = 0; i < count; ++i) {
+        p.put(Point(.5, dist(gen)));
+    }
+    const auto work = kdtree::instrumentation::Counting::thread_snapshot() - before;
+    ASSERT_EQ(p.size(), count);
+    // amortised O(log n) per put, it was O(n) when ties went right
+    ASSERT_LT(work[Counter::RebuiltNodes], 20 * count);
+    ASSERT_LT(work[Counter::NodesVisited], 100 * count);
+
+    auto [first, last] = p.range(Rect(Point(.5, 0.), Point(.5, .5)));
+    ASSERT_EQ(static_cast<std::size_t>(std::distance(first, last)), p.count(Rect(Point(.5, 0.), Point(.5, .5))));
+    for (auto it = p.begin(); it != p.end(); ++it) {
+        ASSERT_TRUE(p.contains(*it));
+    }
+}
+
+TEST(PointSetTest, WorkloadDeterministic)
+{
+    for (const auto distribution : workload::distributions()) {
+        ASSERT_EQ(workload::parse_distribution(workload::name(distribution)), distribution);
+        const auto points = workload::make_points(distribution, 1000, 42);
+        ASSERT_EQ(points.size(), 1000);
+        ASSERT_EQ(workload::make_points(distribution, 1000, 42), points);
+        ASSERT_NE(workload::make_points(distribution, 1000, 43), points);
+    }
+    ASSERT_THROW(workload::parse_distribution("gaussian"), std::runtime_error);
+
+    const auto sorted = workload::make_points(workload::Distribution::Sorted, 1000, 1);
+    ASSERT_TRUE(std::is_sorted(sorted.begin(), sorted.end()));
+    for (const auto & point : workload::make_points(workload::Distribution::Collinear, 1000, 1)) {
+        ASSERT_EQ(point.x(), point.y());
+    }
+    const auto grid = workload::make_points(workload::Distribution::Grid, 1000, 1);
+    ASSERT_LT(std::set<Point>(grid.begin(), grid.end()).size(), grid.size());
+}
+
+// the adversarial workloads, checked against the red-black tree
+TEST(PointSetTest, WorkloadStress)
+{
+    for (const auto distribution : workload::distributions()) {
+        SCOPED_TRACE(workload::name(distribution));
+        const auto points = workload::make_points(distribution, 5000, 7);
+        const auto queries = workload::make_queries(distribution, points, 200, 5, 7);
+        rbtree::PointSet expected(points);
+        kdtree::PointSet p(points);
+        ASSERT_EQ(p.size(), expected.size());
+
+        for (std::size_t i = 0; i < queries.lookups.size(); ++i) {
+            ASSERT_EQ(p.contains(queries.lookups[i]), i % 2 == 0);
+            ASSERT_EQ(expected.contains(queries.lookups[i]), i % 2 == 0);
+        }
+        std::size_t found = 0;
+        for (const auto & rect : workload::make_ranges(points, 200, .01, 7)) {
+            auto range = p.range(rect);
+            auto expected_range = expected.range(rect);
+            const std::set<Point> result(range.first, range.second);
+            ASSERT_EQ(result, std::set<Point>(expected_range.first, expected_range.second));
+            found += result.size();
+        }
+        const double selectivity = static_cast<double>(found) / 200. / static_cast<double>(p.size());
+        ASSERT_GT(selectivity, .005);
+        ASSERT_LT(selectivity, .02);
+
+        // ties make the points ambiguous, the distances are not
+        auto distances = [](const Point & center, auto range) {
+            std::vector<double> result;
+            for (; range.first != range.second; ++range.first) {
+                result.push_back(center.distance(*range.first));
+            }
+            std::sort(result.begin(), result.end());
+            return result;
+        };
+        for (const auto & point : queries.nearest) {
+            ASSERT_EQ(point.distance(*p.nearest(point)), point.distance(*expected.nearest(point)));
+            ASSERT_EQ(distances(point, p.nearest(point, queries.k)), distances(point, expected.nearest(point, queries.k)));
+        }
+    }
+}
+
+using TypesToTest = ::testing::Types<PointSetTest<rbtree::PointSet>, PointSetTest<kdtree::PointSet>, PointSetTest<kdtree::LogPointSet>>;
 INSTANTIATE_TYPED_TEST_SUITE_P(KDTree, IteratorTest, TypesToTest);